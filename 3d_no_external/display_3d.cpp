@@ -28,6 +28,13 @@
 #include <chrono>
 #include <thread>
 
+// Output
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <cerrno>
+
 constexpr size_t WIDTH = 30;
 constexpr size_t HEIGHT = 30;
 
@@ -58,6 +65,123 @@ struct Pixel {
 	}
 };
 
+// Encodes frames as escape sequences into one preallocated buffer and writes each frame with a single write(2)
+// Only color changes are written, so a run of same-colored pixels is just spaces
+struct FrameEncoder {
+	enum class ColorMode {
+		TrueColor, // \033[48;2;r;g;bm
+		Palette256, // \033[48;5;nm with the nearest xterm 256-color entry (fewer bytes and more repeats, for slow links)
+	};
+
+	ColorMode mode = ColorMode::TrueColor;
+	vector<char> buffer;
+	size_t size = 0; // Bytes of the last encoded frame
+
+	// Worst case is a color change at every pixel ("\033[48;2;255;255;255m " is 20 bytes)
+	void reserve(const size_t width, const size_t height) {
+		const size_t needed = width * height * 20 + height + 16;
+		if (buffer.size() < needed) buffer.resize(needed);
+	}
+
+	template <size_t N>
+	static char* put(char* out, const char (&text)[N]) {
+		memcpy(out, text, N - 1);
+		return out + N - 1;
+	}
+
+	// Decimal digits of a number up to 255
+	static char* putNumber(char* out, const unsigned value) {
+		if (value >= 100) {
+			*out++ = '0' + value / 100;
+			*out++ = '0' + value / 10 % 10;
+		}
+		else if (value >= 10) {
+			*out++ = '0' + value / 10;
+		}
+		*out++ = '0' + value % 10;
+		return out;
+	}
+
+	// Nearest entry of the 6x6x6 color cube (16-231) or the gray ramp (232-255)
+	static int paletteIndex(const Pixel& p) {
+		constexpr int LEVELS[6] = { 0, 95, 135, 175, 215, 255 };
+		const auto level = [](const int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+		const auto square = [](const int v) { return v * v; };
+
+		const int r = level(p.r), g = level(p.g), b = level(p.b);
+		const int cubeDist = square(LEVELS[r] - p.r) + square(LEVELS[g] - p.g) + square(LEVELS[b] - p.b);
+
+		// Grays are 8, 18, ..., 238
+		const int average = (p.r + p.g + p.b) / 3;
+		const int gray = min(max((average - 3) / 10, 0), 23);
+		const int grayLevel = 8 + 10 * gray;
+		const int grayDist = square(grayLevel - p.r) + square(grayLevel - p.g) + square(grayLevel - p.b);
+
+		return grayDist < cubeDist ? 232 + gray : 16 + 36 * r + 6 * g + b;
+	}
+
+	void encode(const vector<Pixel>& pixels, const size_t width, const size_t height) {
+		reserve(width, height);
+		char* out = buffer.data();
+
+		// Clear screen and move cursor to top-left
+		out = put(out, "\033[2J\033[H");
+
+		int last = -1; // Color of the previous pixel (packed rgb or palette index), unknown at the start of the frame
+		int lastRgb = -1, lastIndex = 0; // Quantize only when the color changes
+		for (size_t row = 0; row < height; ++row) {
+			for (size_t col = 0; col < width; ++col) {
+				const Pixel& p = pixels[row * width + col];
+				const int color = (p.r << 16) | (p.g << 8) | p.b;
+				if (mode == ColorMode::TrueColor) {
+					if (color != last) {
+						out = put(out, "\033[48;2;");
+						out = putNumber(out, p.r);
+						*out++ = ';';
+						out = putNumber(out, p.g);
+						*out++ = ';';
+						out = putNumber(out, p.b);
+						*out++ = 'm';
+						last = color;
+					}
+				}
+				else {
+					if (color != lastRgb) {
+						lastIndex = paletteIndex(p);
+						lastRgb = color;
+					}
+					const int index = lastIndex;
+					if (index != last) {
+						out = put(out, "\033[48;5;");
+						out = putNumber(out, index);
+						*out++ = 'm';
+						last = index;
+					}
+				}
+				*out++ = ' ';
+			}
+			*out++ = '\n';
+		}
+
+		out = put(out, "\033[0m"); // Reset attributes to default
+		size = out - buffer.data();
+	}
+
+	// Write the encoded frame (in one call unless the kernel takes only part of it)
+	bool flush(const int fd = STDOUT_FILENO) const {
+		size_t written = 0;
+		while (written < size) {
+			const ssize_t n = write(fd, buffer.data() + written, size - written);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			written += n;
+		}
+		return true;
+	}
+};
+
 // Struct that holds image data and renders the image
 struct Display3D {
 	vector<Pixel> flattenedPixels;
@@ -152,6 +276,12 @@ struct Display3D {
 
 		cout << "\033[0m"; // Reset attributes to default
 	}
+
+	// Same output through the frame encoder (one buffer and one write per frame), false if the write failed
+	bool displayorater(FrameEncoder& encoder) const {
+		encoder.encode(flattenedPixels, width, height);
+		return encoder.flush();
+	}
 };
 
 //
@@ -322,7 +452,68 @@ void render_scene(Display3D& image, const Camera& camera, const vector<Sphere>&
 	}
 }
 
-int main() {
+// Encode the orbit frames with the old cout path and the frame encoder, and print bytes per frame and encode time
+void run_benchmark(Display3D& display, const vector<Sphere>& spheres, const vector<Light>& lights, const size_t frames) {
+	vector<vector<Pixel>> images;
+	for (size_t frame = 0; frame < frames; ++frame) {
+		const float angle = frame * degToRad(2.0);
+		Camera camera{ Vec3{ 60.0f * sinf(angle), 0.0f, -60.0f * cosf(angle) }, 0.0f, 0.0f };
+		camera.yaw_degrees = atan2f(-camera.position.x, -camera.position.z) * 180.0f / M_PI;
+
+		display.clear();
+		render_scene(display, camera, spheres, lights);
+		images.push_back(display.flattenedPixels);
+	}
+
+	const auto report = [&](const char* name, const size_t bytes, const double ms) {
+		cout << name << ": " << bytes / frames << " bytes/frame, " << ms * 1000.0 / frames << " us/frame\n";
+	};
+
+	// Old path: cout into a string stream
+	size_t bytes = 0;
+	auto start = chrono::steady_clock::now();
+	for (const auto& image : images) {
+		ostringstream sink;
+		streambuf* terminal = cout.rdbuf(sink.rdbuf());
+		display.flattenedPixels = image;
+		display.displayorater();
+		cout.rdbuf(terminal);
+		bytes += sink.str().size();
+	}
+	report("cout", bytes, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+	for (const auto mode : { FrameEncoder::ColorMode::TrueColor, FrameEncoder::ColorMode::Palette256 }) {
+		FrameEncoder encoder;
+		encoder.mode = mode;
+		encoder.reserve(display.getNumCols(), display.getNumRows());
+
+		bytes = 0;
+		start = chrono::steady_clock::now();
+		for (const auto& image : images) {
+			encoder.encode(image, display.getNumCols(), display.getNumRows());
+			bytes += encoder.size;
+		}
+		report(mode == FrameEncoder::ColorMode::TrueColor ? "encoder truecolor" : "encoder 256-color", bytes,
+			chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+}
+
+int main(int argc, char* argv[]) {
+	FrameEncoder encoder;
+	bool benchmark = false;
+	for (int i = 1; i < argc; ++i) {
+		const string arg = argv[i];
+		if (arg == "--colors" && i + 1 < argc && string{ argv[i + 1] } == "256") encoder.mode = FrameEncoder::ColorMode::Palette256, ++i;
+		else if (arg == "--colors" && i + 1 < argc && string{ argv[i + 1] } == "true") encoder.mode = FrameEncoder::ColorMode::TrueColor, ++i;
+		else if (arg == "--bench") benchmark = true;
+		else {
+			cerr << "Usage: " << argv[0] << " [--colors true|256] [--bench]\n"
+				<< "  --colors  Truecolor (default) or the 256-color palette for slow links\n"
+				<< "  --bench   Print bytes per frame and encode time of each output path instead of animating\n";
+			return 1;
+		}
+	}
+
 	// Display3D display{ 20, 20 };
 	Display3D display{ 30, 30 };
 	// Display3D display{ 40, 40 };
@@ -348,6 +539,11 @@ int main() {
 	// render_scene(img, camera, spheres, lights);
 	// display.displayorater(img);
 
+	if (benchmark) {
+		run_benchmark(display, spheres, lights, 200);
+		return 0;
+	}
+
 	for (size_t frame = 0; frame < 200; ++frame) {
 		display.clear();
 
@@ -371,8 +567,10 @@ int main() {
 		camera.pitch_degrees = 0.0f;
 
 		render_scene(display, camera, spheres, lights);
-		display.displayorater();
-		cout << flush;
+		if (!display.displayorater(encoder)) {
+			cerr << "Failed to write frame " << frame << ": " << strerror(errno) << "\n";
+			return 1;
+		}
 
 		// ~33ms for 30 fps
 		std::this_thread::sleep_for(std::chrono::milliseconds(33));
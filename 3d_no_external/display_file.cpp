@@ -4,48 +4,573 @@
 #include <string>
 #include <chrono>
 #include <thread>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
 
 using namespace std;
 
 // Use to display a prerendered scene
 // Scene can be prerendered by directing the output of the display to a file
 // Ex: ./display_3d > display_3d.anim; ./display_file display_3d.anim
+//
+// Raw ANSI dumps are huge, so they can be exported to a compact animation file that plays the same way
+// Ex: ./display_file --export display_3d.anim display_3d.d3a --compress; ./display_file display_3d.d3a
+//
+// Animation file layout (host byte order):
+//   AnimHeader
+//   Frames, each a FrameHeader followed by its payload
+//   Index of all frames (at header.indexOffset), so any frame is found without reading the ones before it
+//
+// A frame payload is a list of runs over the pixels (row by row) that change the previous frame into this one:
+//   SKIP n (pixels unchanged), COPY n (n literal pixels follow), FILL n (one pixel follows, repeated n times)
+// Keyframes are runs over a black frame instead, so decoding can start at any keyframe. The payload is
+// optionally compressed with a small LZ77 coder (kept only when it's smaller).
 
-// Reads all frames from the file, assuming each frame is separated by "\033[0m"
-vector<string> read_frames(const string& filename) {
-    ifstream infile(filename);
-    string data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
-    vector<string> frames;
+constexpr char ANIM_MAGIC[8] = { 'D', '3', 'D', 'A', 'N', 'I', 'M', '\0' };
+constexpr uint32_t ANIM_VERSION = 1;
 
-    const string delimiter = "\033[0m";
-    size_t start = 0, end;
-    while ((end = data.find(delimiter, start)) != string::npos) {
-        string frame = data.substr(start, end - start + delimiter.size());
-        frames.push_back(frame);
-        start = end + delimiter.size();
+struct AnimHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height; // In pixels (a pixel is one character)
+    uint32_t frameCount;
+    uint32_t frameMs; // Delay between frames
+    uint32_t keyframeInterval;
+    uint64_t indexOffset;
+};
+
+enum FrameFlags : uint8_t {
+    FRAME_KEYFRAME = 1,
+    FRAME_COMPRESSED = 2,
+};
+
+struct FrameHeader {
+    uint32_t payloadSize; // Bytes stored in the file
+    uint32_t rawSize; // Bytes of runs after decompression
+    uint8_t flags;
+    uint8_t padding[3];
+};
+
+struct IndexEntry {
+    uint64_t offset; // Of the FrameHeader
+    uint32_t keyframe; // Frame to start decoding from to reach this frame
+    uint32_t padding;
+};
+
+static_assert(sizeof(AnimHeader) == 40 && sizeof(FrameHeader) == 12 && sizeof(IndexEntry) == 16, "Animation records must not be padded");
+
+enum RunKind : uint8_t {
+    RUN_SKIP = 0,
+    RUN_COPY = 1,
+    RUN_FILL = 2,
+};
+
+struct Pixel {
+    uint8_t r, g, b;
+
+    bool operator==(const Pixel& p) const {
+        return r == p.r && g == p.g && b == p.b;
     }
-    return frames;
+    bool operator!=(const Pixel& p) const {
+        return !(*this == p);
+    }
+};
+
+//
+// Variable length integers and the LZ77 coder
+//
+
+void put_varint(vector<uint8_t>& out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
 }
 
-void display_frame(const string& frame) {
-    cout << frame << flush;
+bool get_varint(const uint8_t*& p, const uint8_t* end, size_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const uint8_t byte = *p++;
+        value |= static_cast<size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <frames_file.txt>\n";
+// Sequences of: literal length, literals, match offset (2 bytes), match length - 4. The last sequence has no match.
+void lz_compress(const vector<uint8_t>& in, vector<uint8_t>& out) {
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t MAX_OFFSET = 65535;
+    constexpr int HASH_BITS = 14;
+
+    out.clear();
+    vector<uint32_t> table(size_t{ 1 } << HASH_BITS, UINT32_MAX); // Last position of each 4 byte hash
+
+    const size_t n = in.size();
+    size_t anchor = 0, i = 0;
+    while (i + MIN_MATCH <= n) {
+        uint32_t word;
+        memcpy(&word, &in[i], sizeof(word));
+        const uint32_t hash = (word * 2654435761u) >> (32 - HASH_BITS);
+        const uint32_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(i);
+
+        if (candidate == UINT32_MAX || i - candidate > MAX_OFFSET || memcmp(&in[candidate], &in[i], MIN_MATCH) != 0) {
+            ++i;
+            continue;
+        }
+
+        size_t length = MIN_MATCH;
+        while (i + length < n && in[candidate + length] == in[i + length]) ++length;
+
+        put_varint(out, i - anchor);
+        out.insert(out.end(), in.begin() + anchor, in.begin() + i);
+        const size_t offset = i - candidate;
+        out.push_back(static_cast<uint8_t>(offset));
+        out.push_back(static_cast<uint8_t>(offset >> 8));
+        put_varint(out, length - MIN_MATCH);
+
+        i += length;
+        anchor = i;
+    }
+
+    put_varint(out, n - anchor);
+    out.insert(out.end(), in.begin() + anchor, in.end());
+}
+
+bool lz_decompress(const uint8_t* p, const uint8_t* end, const size_t rawSize, vector<uint8_t>& out) {
+    out.clear();
+    out.reserve(rawSize);
+    while (true) {
+        size_t literals;
+        if (!get_varint(p, end, literals) || literals > static_cast<size_t>(end - p) || out.size() + literals > rawSize) return false;
+        out.insert(out.end(), p, p + literals);
+        p += literals;
+        if (p == end) return out.size() == rawSize;
+
+        size_t length;
+        if (end - p < 2) return false;
+        const size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        if (!get_varint(p, end, length)) return false;
+        // The length comes from the file, so check it against the room left before adding the minimum match (no overflow)
+        if (offset == 0 || offset > out.size() || length > rawSize - out.size() || rawSize - out.size() - length < 4) return false;
+        length += 4;
+
+        // Byte by byte, matches may overlap the bytes they produce
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < length; ++k) out.push_back(out[from++]);
+    }
+}
+
+//
+// Frame runs
+//
+
+// Encode the runs that turn previous into current
+void encode_runs(const vector<Pixel>& previous, const vector<Pixel>& current, vector<uint8_t>& out) {
+    constexpr size_t MIN_FILL = 4; // Shorter repeats are cheaper as literals
+    out.clear();
+
+    const size_t n = current.size();
+    size_t i = 0;
+    while (i < n) {
+        size_t run = i;
+        while (run < n && current[run] == previous[run]) ++run;
+        if (run > i) {
+            out.push_back(RUN_SKIP);
+            put_varint(out, run - i);
+            i = run;
+            continue;
+        }
+
+        run = i + 1;
+        while (run < n && current[run] == current[i]) ++run;
+        if (run - i >= MIN_FILL) {
+            out.push_back(RUN_FILL);
+            put_varint(out, run - i);
+            out.insert(out.end(), { current[i].r, current[i].g, current[i].b });
+            i = run;
+            continue;
+        }
+
+        // Literals until an unchanged pixel or a repeat worth filling starts
+        size_t literalEnd = i + 1;
+        while (literalEnd < n && current[literalEnd] != previous[literalEnd]) {
+            size_t repeat = literalEnd + 1;
+            while (repeat < n && repeat - literalEnd < MIN_FILL && current[repeat] == current[literalEnd]) ++repeat;
+            if (repeat - literalEnd >= MIN_FILL) break;
+            ++literalEnd;
+        }
+        out.push_back(RUN_COPY);
+        put_varint(out, literalEnd - i);
+        for (size_t k = i; k < literalEnd; ++k) out.insert(out.end(), { current[k].r, current[k].g, current[k].b });
+        i = literalEnd;
+    }
+}
+
+// Apply runs to the pixels of the previous frame (or a black frame for keyframes)
+bool decode_runs(const vector<uint8_t>& runs, vector<Pixel>& pixels) {
+    const uint8_t* p = runs.data();
+    const uint8_t* end = p + runs.size();
+    size_t i = 0;
+    while (p < end) {
+        const uint8_t kind = *p++;
+        size_t count;
+        if (!get_varint(p, end, count) || count > pixels.size() - i) return false;
+
+        if (kind == RUN_SKIP) {
+            i += count;
+        }
+        else if (kind == RUN_FILL) {
+            if (end - p < 3) return false;
+            fill(pixels.begin() + i, pixels.begin() + i + count, Pixel{ p[0], p[1], p[2] });
+            p += 3;
+            i += count;
+        }
+        else if (kind == RUN_COPY) {
+            if (static_cast<size_t>(end - p) / 3 < count) return false;
+            for (size_t k = 0; k < count; ++k, p += 3) pixels[i++] = Pixel{ p[0], p[1], p[2] };
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// ANSI dumps (the output of display_3d)
+//
+
+// Reads frames one at a time, assuming each frame is separated by "\033[0m" (only one frame is held in memory)
+struct AnsiFrameReader {
+    ifstream infile;
+    string frame;
+
+    explicit AnsiFrameReader(const string& filename) : infile{ filename, ios::binary } {}
+
+    bool next() {
+        static const string delimiter = "\033[0m";
+        frame.clear();
+
+        char c;
+        while (infile.get(c)) {
+            frame.push_back(c);
+            if (c == 'm' && frame.size() >= delimiter.size() && frame.compare(frame.size() - delimiter.size(), delimiter.size(), delimiter) == 0) return true;
+        }
+        return false; // Incomplete trailing frames are dropped like before
+    }
+};
+
+// RGB of an xterm 256-color palette entry
+Pixel palette_color(const int index) {
+    static const Pixel SYSTEM[16] = {
+        { 0, 0, 0 }, { 128, 0, 0 }, { 0, 128, 0 }, { 128, 128, 0 }, { 0, 0, 128 }, { 128, 0, 128 }, { 0, 128, 128 }, { 192, 192, 192 },
+        { 128, 128, 128 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 }, { 0, 0, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 },
+    };
+    static const uint8_t LEVELS[6] = { 0, 95, 135, 175, 215, 255 };
+
+    if (index < 16) return SYSTEM[index];
+    if (index < 232) return Pixel{ LEVELS[(index - 16) / 36], LEVELS[(index - 16) / 6 % 6], LEVELS[(index - 16) % 6] };
+    const uint8_t gray = static_cast<uint8_t>(8 + 10 * (index - 232));
+    return Pixel{ gray, gray, gray };
+}
+
+// Parse the background colors of one frame into pixels (one pixel per space, one row per line)
+bool parse_ansi_frame(const string& frame, vector<Pixel>& pixels, size_t& width, size_t& height) {
+    pixels.clear();
+    width = height = 0;
+
+    Pixel color{ 0, 0, 0 };
+    size_t rowWidth = 0;
+    for (size_t i = 0; i < frame.size(); ++i) {
+        const char c = frame[i];
+        if (c == '\033' && i + 1 < frame.size() && frame[i + 1] == '[') {
+            // Escape sequence: parameters until the final letter
+            size_t end = i + 2;
+            while (end < frame.size() && !isalpha(static_cast<unsigned char>(frame[end]))) ++end;
+            if (end == frame.size()) return false;
+
+            if (frame[end] == 'm') {
+                int r, g, b;
+                const string params = frame.substr(i + 2, end - i - 2);
+                if (sscanf(params.c_str(), "48;2;%d;%d;%d", &r, &g, &b) == 3) color = Pixel{ static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b) };
+                else if (sscanf(params.c_str(), "48;5;%d", &r) == 1 && r >= 0 && r < 256) color = palette_color(r); // 256-color output of display_3d
+            }
+            i = end;
+        }
+        else if (c == ' ') {
+            pixels.push_back(color);
+            ++rowWidth;
+        }
+        else if (c == '\n') {
+            if (height == 0) width = rowWidth;
+            else if (rowWidth != width) return false;
+            ++height;
+            rowWidth = 0;
+        }
+    }
+
+    return rowWidth == 0 && height > 0;
+}
+
+// Print pixels the way display_3d does
+void display_pixels(const vector<Pixel>& pixels, const size_t width, const size_t height, string& out) {
+    out = "\033[2J\033[H";
+    for (size_t row = 0; row < height; ++row) {
+        for (size_t col = 0; col < width; ++col) {
+            const Pixel& p = pixels[row * width + col];
+            out += "\033[48;2;" + to_string(p.r) + ";" + to_string(p.g) + ";" + to_string(p.b) + "m ";
+        }
+        out += "\n";
+    }
+    out += "\033[0m";
+    cout << out << flush;
+}
+
+//
+// Animation files
+//
+
+// Convert an ANSI dump into an animation file, streaming one frame at a time
+int export_animation(const string& inName, const string& outName, const uint32_t keyframeInterval, const bool compress, const uint32_t frameMs) {
+    AnsiFrameReader reader{ inName };
+    ofstream outfile{ outName, ios::binary };
+    if (!reader.infile || !outfile) {
+        cerr << "Failed to open " << (reader.infile ? outName : inName) << "\n";
         return 1;
     }
 
-    auto frames = read_frames(argv[1]);
-    if (frames.empty()) {
+    AnimHeader header{};
+    memcpy(header.magic, ANIM_MAGIC, sizeof(ANIM_MAGIC));
+    header.version = ANIM_VERSION;
+    header.frameMs = frameMs;
+    header.keyframeInterval = keyframeInterval;
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header)); // Rewritten with the totals at the end
+
+    vector<IndexEntry> index;
+    vector<Pixel> previous, current;
+    vector<uint8_t> runs, compressed;
+    size_t width = 0, height = 0;
+    uint64_t ansiBytes = 0;
+    uint64_t offset = sizeof(header);
+    while (reader.next()) {
+        ansiBytes += reader.frame.size();
+
+        size_t frameWidth, frameHeight;
+        if (!parse_ansi_frame(reader.frame, current, frameWidth, frameHeight) || (!index.empty() && (frameWidth != width || frameHeight != height))) {
+            cerr << "Frame " << index.size() << " of " << inName << " is malformed or changes size\n";
+            return 1;
+        }
+        width = frameWidth;
+        height = frameHeight;
+
+        const bool keyframe = index.size() % keyframeInterval == 0;
+        if (keyframe) previous.assign(current.size(), Pixel{ 0, 0, 0 });
+        encode_runs(previous, current, runs);
+
+        FrameHeader frameHeader{};
+        frameHeader.rawSize = static_cast<uint32_t>(runs.size());
+        frameHeader.flags = keyframe ? FRAME_KEYFRAME : 0;
+        const vector<uint8_t>* payload = &runs;
+        if (compress) {
+            lz_compress(runs, compressed);
+            if (compressed.size() < runs.size()) {
+                payload = &compressed;
+                frameHeader.flags |= FRAME_COMPRESSED;
+            }
+        }
+        frameHeader.payloadSize = static_cast<uint32_t>(payload->size());
+
+        const uint32_t keyframeIndex = static_cast<uint32_t>(index.size() - index.size() % keyframeInterval);
+        index.push_back(IndexEntry{ offset, keyframeIndex, 0 });
+        outfile.write(reinterpret_cast<const char*>(&frameHeader), sizeof(frameHeader));
+        outfile.write(reinterpret_cast<const char*>(payload->data()), payload->size());
+        offset += sizeof(frameHeader) + payload->size();
+
+        swap(previous, current);
+    }
+
+    if (index.empty()) {
         cerr << "No frames found in file.\n";
         return 1;
     }
 
-    for (const auto& frame : frames) {
-        display_frame(frame);
+    outfile.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+    header.width = static_cast<uint32_t>(width);
+    header.height = static_cast<uint32_t>(height);
+    header.frameCount = static_cast<uint32_t>(index.size());
+    header.indexOffset = offset;
+    outfile.seekp(0);
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!outfile) {
+        cerr << "Failed to write " << outName << "\n";
+        return 1;
+    }
+
+    const uint64_t animBytes = offset + index.size() * sizeof(IndexEntry);
+    cerr << "Exported " << index.size() << " frames (" << width << "x" << height << "): " << ansiBytes << " bytes -> " << animBytes << " bytes\n";
+    return 0;
+}
+
+// Plays an animation file, reading only the frames it shows (memory stays at one frame plus the index)
+struct AnimationReader {
+    ifstream infile;
+    AnimHeader header{};
+    vector<IndexEntry> index;
+    vector<Pixel> pixels; // Last decoded frame
+    size_t decoded = SIZE_MAX; // Index of the frame in pixels
+    vector<uint8_t> payload, runs;
+
+    static constexpr uint64_t MAX_PIXELS = 1 << 26; // Far beyond any terminal
+    static constexpr uint64_t MAX_RUN_BYTES_PER_PIXEL = 14; // A one pixel COPY run: kind, 10 byte varint, 3 bytes of color
+
+    // Sizes and offsets come from the file, so they are checked against the file size before anything is allocated
+    bool open(const string& filename) {
+        infile.open(filename, ios::binary);
+        if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (memcmp(header.magic, ANIM_MAGIC, sizeof(ANIM_MAGIC)) != 0 || header.version != ANIM_VERSION || header.frameCount == 0) return false;
+
+        const uint64_t frameSize = static_cast<uint64_t>(header.width) * header.height;
+        if (frameSize == 0 || frameSize > MAX_PIXELS) return false;
+
+        infile.seekg(0, ios::end);
+        const uint64_t fileSize = static_cast<uint64_t>(infile.tellg());
+        if (header.indexOffset < sizeof(header) || header.indexOffset > fileSize) return false;
+        if (header.frameCount > (fileSize - header.indexOffset) / sizeof(IndexEntry)) return false;
+
+        index.resize(header.frameCount);
+        infile.seekg(header.indexOffset);
+        if (!infile.read(reinterpret_cast<char*>(index.data()), index.size() * sizeof(IndexEntry))) return false;
+        for (size_t frame = 0; frame < index.size(); ++frame) {
+            const IndexEntry& entry = index[frame];
+            if (entry.offset < sizeof(header) || entry.offset > header.indexOffset - sizeof(FrameHeader) || entry.keyframe > frame) return false;
+        }
+
+        pixels.assign(frameSize, Pixel{ 0, 0, 0 });
+        return true;
+    }
+
+    bool decode(const size_t frame) {
+        const IndexEntry& entry = index[frame];
+        FrameHeader frameHeader;
+        infile.seekg(entry.offset);
+        if (!infile.read(reinterpret_cast<char*>(&frameHeader), sizeof(frameHeader))) return false;
+        if (frameHeader.payloadSize > header.indexOffset - sizeof(FrameHeader) - entry.offset) return false;
+        if (frameHeader.rawSize > pixels.size() * MAX_RUN_BYTES_PER_PIXEL) return false;
+        if (!(frameHeader.flags & FRAME_COMPRESSED) && frameHeader.rawSize != frameHeader.payloadSize) return false;
+
+        payload.resize(frameHeader.payloadSize);
+        if (!infile.read(reinterpret_cast<char*>(payload.data()), payload.size())) return false;
+
+        if (frameHeader.flags & FRAME_COMPRESSED) {
+            if (!lz_decompress(payload.data(), payload.data() + payload.size(), frameHeader.rawSize, runs)) return false;
+        }
+        else {
+            runs.swap(payload);
+        }
+
+        if (frameHeader.flags & FRAME_KEYFRAME) fill(pixels.begin(), pixels.end(), Pixel{ 0, 0, 0 });
+        if (!decode_runs(runs, pixels)) return false;
+        decoded = frame;
+        return true;
+    }
+
+    // Decode a frame, starting from its keyframe unless the previous frame is already decoded
+    bool seek(const size_t frame) {
+        if (frame >= index.size()) return false;
+        size_t start = index[frame].keyframe;
+        if (decoded != SIZE_MAX && decoded < frame && decoded >= start) start = decoded + 1;
+
+        for (size_t f = start; f <= frame; ++f) {
+            if (!decode(f)) return false;
+        }
+        return true;
+    }
+};
+
+int play_animation(const string& filename, const size_t startFrame) {
+    AnimationReader reader;
+    if (!reader.open(filename)) {
+        cerr << "Failed to read " << filename << "\n";
+        return 1;
+    }
+
+    string out;
+    for (size_t frame = startFrame; frame < reader.header.frameCount; ++frame) {
+        if (!reader.seek(frame)) {
+            cerr << "Frame " << frame << " of " << filename << " is corrupt\n";
+            return 1;
+        }
+        display_pixels(reader.pixels, reader.header.width, reader.header.height, out);
+        std::this_thread::sleep_for(std::chrono::milliseconds(reader.header.frameMs));
+    }
+    return 0;
+}
+
+int play_ansi(const string& filename) {
+    AnsiFrameReader reader{ filename };
+    bool any = false;
+    while (reader.next()) {
+        any = true;
+        cout << reader.frame << flush;
         std::this_thread::sleep_for(std::chrono::milliseconds(33)); // ~30 FPS
     }
+
+    if (!any) {
+        cerr << "No frames found in file.\n";
+        return 1;
+    }
     return 0;
 }
+
+void print_usage(const char* program) {
+    cerr << "Usage: " << program << " <frames_file> [--start N]\n"
+         << "       " << program << " --export <frames_file.anim> <animation.d3a> [--keyframes N] [--compress] [--frame-ms N]\n"
+         << "  frames_file    ANSI dump of display_3d or an exported animation file\n"
+         << "  --start N      First frame to show (animation files only)\n"
+         << "  --keyframes N  Frames between keyframes when exporting (default: 30, seeking decodes at most this many)\n"
+         << "  --compress     Compress frames when exporting\n"
+         << "  --frame-ms N   Delay between frames when exporting (default: 33, ~30 FPS)\n";
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> files;
+    size_t startFrame = 0;
+    uint32_t keyframeInterval = 30, frameMs = 33;
+    bool exporting = false, compress = false, badOption = false;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const string arg = argv[i];
+            const bool hasValue = i + 1 < argc;
+            if (arg == "--export") exporting = true;
+            else if (arg == "--compress") compress = true;
+            else if (arg == "--start" && hasValue) startFrame = stoul(argv[++i]);
+            else if (arg == "--keyframes" && hasValue) keyframeInterval = static_cast<uint32_t>(stoul(argv[++i]));
+            else if (arg == "--frame-ms" && hasValue) frameMs = static_cast<uint32_t>(stoul(argv[++i]));
+            else if (arg.rfind("--", 0) != 0) files.push_back(arg);
+            else badOption = true;
+        }
+    }
+    catch (const exception&) { // Number conversion failed
+        badOption = true;
+    }
+
+    if (badOption || files.size() != (exporting ? 2u : 1u) || keyframeInterval == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (exporting) return export_animation(files[0], files[1], keyframeInterval, compress, frameMs);
+
+    // Animation files start with the magic, anything else is treated as an ANSI dump
+    char magic[sizeof(ANIM_MAGIC)] = {};
+    ifstream{ files[0], ios::binary }.read(magic, sizeof(magic));
+    if (memcmp(magic, ANIM_MAGIC, sizeof(ANIM_MAGIC)) == 0) return play_animation(files[0], startFrame);
+    return play_ansi(files[0]);
+}
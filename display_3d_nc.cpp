@@ -3,11 +3,38 @@
 #include <cmath>
 #include <algorithm>
 #include <memory> // For smart pointers
+#include <typeinfo> // Exact object types for dispatch
+#include <cstdint>
+#include <random>
+#include <new> // Aligned new for SIMD arrays
+
+// SIMD intrinsics (the widest instruction set enabled by the compiler flags is used)
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <fstream>
+#include <charconv> // Fast number parsing for scene files
+
+// Memory mapped scene files
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // Sleep
 #include <thread>
 #include <chrono>
 
+// Worker pool
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+
 // notcurses for terminal rendering and keyboard input (https://github.com/dankamongmen/notcurses)
 #include <notcurses/notcurses.h>
 
@@ -22,6 +49,9 @@ constexpr float SPECULAR_SHININESS = 32.0f; // Specular shininess factor (higher
 constexpr float FOV = 90.0f; // The zoom
 constexpr float MOUSE_SENSITIVITY = 0.7f;
 
+constexpr size_t TILE_SIZE = 16; // Width and height of a render tile in pixels
+constexpr size_t PACKET_SIZE = 8; // Width and height of a primary ray packet in pixels (must divide TILE_SIZE)
+
 
 constexpr float degToRad(const float degrees) {
 	return degrees * M_PI / 180.0f;
@@ -37,22 +67,354 @@ struct Pixel {
 
 	Pixel() : Pixel{ 0, 0, 0 } {}
 	Pixel(const u_char r, const u_char g, const u_char b) : r{ r }, g{ g }, b{ b } {}
+
+	bool operator==(const Pixel& p) const {
+		return r == p.r && g == p.g && b == p.b;
+	}
+	bool operator!=(const Pixel& p) const {
+		return !(*this == p);
+	}
+};
+
+// Persistent pool of worker threads with per-worker tile queues (idle workers steal from the back of other queues)
+// The calling thread always works as worker 0, so a pool of 1 thread runs every task inline and in order
+struct WorkerPool {
+	// A queue of task indices owned by one worker
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<size_t> tasks;
+	};
+
+	size_t numThreads;
+	vector<std::thread> workers;
+	unique_ptr<WorkQueue[]> queues;
+
+	std::mutex lock;
+	std::condition_variable wake; // Signals workers that a new job was posted (or the pool is stopping)
+	std::condition_variable done; // Signals the caller that all workers finished the job
+	const std::function<void(size_t)>* job = nullptr;
+	size_t generation = 0; // Incremented for every job so sleeping workers know there is new work
+	size_t busyWorkers = 0; // Background workers still working on the current job
+	bool stopping = false;
+
+	explicit WorkerPool(const size_t threads) : numThreads{ max<size_t>(threads, 1) }, queues{ make_unique<WorkQueue[]>(numThreads) } {
+		for (size_t id = 1; id < numThreads; ++id) {
+			workers.emplace_back([this, id]() { workerLoop(id); });
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> guard{ lock };
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers) worker.join();
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	size_t getNumThreads() const {
+		return numThreads;
+	}
+
+	// Run task(0) ... task(numTasks - 1) across the pool and return once all of them have finished
+	void run(const size_t numTasks, const std::function<void(size_t)>& task) {
+		if (numThreads == 1) {
+			for (size_t i = 0; i < numTasks; ++i) task(i);
+			return;
+		}
+
+		// Hand each worker a contiguous range of tasks (neighbouring tiles share cache lines and objects)
+		for (size_t id = 0; id < numThreads; ++id) {
+			const size_t first = numTasks * id / numThreads;
+			const size_t last = numTasks * (id + 1) / numThreads;
+
+			std::lock_guard<std::mutex> guard{ queues[id].lock };
+			for (size_t i = first; i < last; ++i) queues[id].tasks.push_back(i);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard{ lock };
+			job = &task;
+			busyWorkers = workers.size();
+			++generation;
+		}
+		wake.notify_all();
+
+		drainQueues(0, task);
+
+		// Wait for the background workers so the task is never used after we return
+		std::unique_lock<std::mutex> guard{ lock };
+		done.wait(guard, [this]() { return busyWorkers == 0; });
+		job = nullptr;
+	}
+
+private:
+	// Pop from the front of our own queue
+	bool popOwn(const size_t id, size_t& taskIndex) {
+		std::lock_guard<std::mutex> guard{ queues[id].lock };
+		if (queues[id].tasks.empty()) return false;
+		taskIndex = queues[id].tasks.front();
+		queues[id].tasks.pop_front();
+		return true;
+	}
+
+	// Steal from the back of another worker's queue (the work it would have reached last)
+	bool steal(const size_t id, size_t& taskIndex) {
+		for (size_t offset = 1; offset < numThreads; ++offset) {
+			WorkQueue& victim = queues[(id + offset) % numThreads];
+
+			std::lock_guard<std::mutex> guard{ victim.lock };
+			if (victim.tasks.empty()) continue;
+			taskIndex = victim.tasks.back();
+			victim.tasks.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	void drainQueues(const size_t id, const std::function<void(size_t)>& task) {
+		size_t taskIndex;
+		while (popOwn(id, taskIndex) || steal(id, taskIndex)) {
+			task(taskIndex);
+		}
+	}
+
+	void workerLoop(const size_t id) {
+		size_t seenGeneration = 0;
+		while (true) {
+			const std::function<void(size_t)>* currentJob;
+			{
+				std::unique_lock<std::mutex> guard{ lock };
+				wake.wait(guard, [&]() { return stopping || generation != seenGeneration; });
+				if (stopping) return;
+				seenGeneration = generation;
+				currentJob = job;
+			}
+
+			drainQueues(id, *currentJob);
+
+			{
+				std::lock_guard<std::mutex> guard{ lock };
+				--busyWorkers;
+			}
+			done.notify_one();
+		}
+	}
 };
 
 // Forward declarations for Display3D render function
 struct Camera;
-struct Object;
-struct Light;
+struct Scene;
+
+// How the image is put on the terminal
+enum class Backend {
+	Cells, // One space with a background color per pixel (2:1 tall pixels)
+	HalfBlock, // ncvisual blit, 1x2 pixels per cell
+	Quadrant, // ncvisual blit, 2x2 pixels per cell
+	Sextant, // ncvisual blit, 2x3 pixels per cell
+	Bitmap, // ncvisual blit with sixel/kitty graphics, one pixel per terminal pixel
+};
+
+// State of the terminal plane the image is presented on (shared by every Display3D that presents to it)
+struct PlaneOutput {
+	struct ncplane* plane;
+
+	// What the plane currently shows, so only changed cells are written
+	vector<Pixel> presentedPixels;
+	bool presentedValid = false; // False when the plane contents are unknown (first frame, resize, erase)
+	std::string blanks; // Row of spaces used to write runs of cells in one call
+	size_t cellsTouched = 0; // Cells written by the last present
+
+	vector<uint32_t> rgba; // Image converted for ncvisual (bytes in R, G, B, A order)
+	ncplane* visualPlane = nullptr; // Child plane the visual is blitted onto
+
+	explicit PlaneOutput(ncplane* p) : plane{ p } {}
+
+	~PlaneOutput() {
+		if (visualPlane) ncplane_destroy(visualPlane);
+	}
+
+	PlaneOutput(const PlaneOutput&) = delete;
+	PlaneOutput& operator=(const PlaneOutput&) = delete;
+
+	// Redraw every cell on the next present (call after the plane was erased, resized, or changed behind our back)
+	void invalidate() {
+		presentedValid = false;
+
+		// The visual plane is recreated at the new size on the next blit
+		if (visualPlane) {
+			ncplane_destroy(visualPlane);
+			visualPlane = nullptr;
+		}
+	}
+};
+
+// Primary ray directions reused across frames
+// Camera space directions depend only on the render size, aspect ratio, and FOV. World space directions
+// additionally depend on yaw and pitch, but not on the camera position, so moving the camera reuses them.
+struct RayDirectionCache {
+	size_t width = 0, height = 0;
+	float aspect = 0.0f, fov = 0.0f;
+	float yawDegrees = NAN, pitchDegrees = NAN; // Orientation the world directions were rotated for
+	vector<float> cameraSpace; // Normalized (x, y, forward) per pixel
+	vector<float> world; // World space (x, y, z) per pixel
+
+	void invalidate() {
+		width = height = 0;
+	}
+};
+
+// Whether pixels from the previous frame are reused instead of traced again
+enum class TemporalReuse {
+	Off, // Trace every pixel every frame
+	Static, // Reuse pixels no changed object can affect while the camera stands still (exact)
+	Reproject, // Also move pixels along with small camera motions (approximate, view-dependent shading lags)
+};
+
+// What each pixel showed last frame, for reusing pixels that didn't change
+struct PixelHistory {
+	static constexpr uint32_t MISS = UINT32_MAX; // Id of pixels that didn't hit anything
+
+	bool valid = false;
+	size_t width = 0, height = 0;
+	float aspect = 0.0f;
+	float position[3] = {}; // Camera the history was rendered with
+	float yawDegrees = 0.0f, pitchDegrees = 0.0f;
+	uint64_t sceneClock = 0; // Scene changes up to this clock are included
+
+	// Per pixel
+	vector<uint32_t> ids; // Object hit
+	vector<float> dists; // Distance from the camera to the hit
+	vector<Pixel> colors; // Shaded color
+	vector<uint8_t> ages; // Frames since the pixel was traced (reprojected pixels only)
+	vector<uint8_t> retrace; // This frame: 1 = trace again, 0 = reuse
+
+	// Scratch for reprojection and dirty objects (kept to avoid reallocating every frame)
+	vector<uint32_t> nextIds;
+	vector<float> nextDists;
+	vector<Pixel> nextColors;
+	vector<uint8_t> nextAges;
+	vector<uint8_t> dirty; // Per object: changed since the history was rendered
+	vector<uint32_t> changed;
+
+	size_t reusedPixels = 0; // Pixels of the last frame that weren't traced
+
+	void invalidate() {
+		valid = false;
+	}
+};
+
+// Colors summed over jittered samples per pixel, for progressive anti-aliasing while the view holds still
+struct SampleAccumulator {
+	bool valid = false;
+	size_t width = 0, height = 0;
+	float aspect = 0.0f;
+	float position[3] = {}; // Camera the samples were traced with
+	float yawDegrees = 0.0f, pitchDegrees = 0.0f;
+	uint64_t sceneClock = 0; // Scene changes up to this clock are included
+
+	size_t samples = 0; // Samples per pixel so far
+	vector<float> sums; // Summed r, g, b per pixel
+
+	void invalidate() {
+		valid = false;
+	}
+};
+
+// Adaptive anti-aliasing: after the first pass, pixels on edges (the object, normal, or color changes to a neighbor) get
+// extra rays, most contrasted edges first, up to a budget per frame
+struct EdgeSampler {
+	static constexpr size_t SAMPLES = 4; // Extra rays per edge pixel (rotated grid)
+
+	size_t budget = 0; // Extra rays per frame (0 = off)
+
+	// Per pixel, from the first pass
+	vector<uint32_t> ids; // Object hit (PixelHistory::MISS for none)
+	vector<float> normals; // Surface normal (x, y, z)
+
+	// Scratch
+	vector<uint32_t> contrasts; // Largest contrast to a neighbor per pixel
+	vector<std::pair<uint32_t, uint32_t>> edges; // (contrast, pixel) of the edge pixels
+
+	size_t edgePixels = 0; // Edge pixels found in the last frame
+	size_t sampledPixels = 0; // Edge pixels that got extra rays within the budget
+};
+
+// Surfaces the pixels see, written by the trace pass of deferred shading and lit by the shading pass
+// Kept between frames, so a frame where only the lights changed is lit again without tracing
+struct GBuffer {
+	bool valid = false;
+	size_t width = 0, height = 0;
+	float aspect = 0.0f;
+	float position[3] = {}; // Camera the buffer was traced with
+	float yawDegrees = 0.0f, pitchDegrees = 0.0f;
+	uint64_t geometryClock = 0; // Object changes up to this clock are included
+
+	static constexpr size_t CHUNK = 256; // Pixels the shading pass lights together (arrays are padded to whole chunks)
+
+	// Per pixel, structure of arrays so the shading pass vectorizes over pixels
+	vector<uint32_t> ids; // Object hit (PixelHistory::MISS for none)
+	vector<float> dists;
+	vector<float> normalX, normalY, normalZ;
+	vector<float> albedoR, albedoG, albedoB; // Surface color over RGB_MAX_FLOAT
+
+	size_t relitFrames = 0; // Frames shaded from the buffer without tracing
+
+	void invalidate() {
+		valid = false;
+	}
+};
+
+// How a render at a lower internal resolution is stretched over the image
+enum class UpscaleFilter {
+	Nearest, // Blocky, cheapest
+	Bilinear, // Smooth, blurs silhouettes
+	EdgeAware, // Bilinear inside surfaces, nearest across color edges so silhouettes stay sharp
+};
 
 // Struct that holds image data and renders the image
 struct Display3D {
 	vector<Pixel> flattenedPixels; // 2D array flattened into 1D array of pixels
 	size_t width;
 	size_t height;
-	struct ncplane* plane;
+	PlaneOutput* output; // Where the image is presented (null when rendering headless)
+	WorkerPool* pool = nullptr; // Renders tiles in parallel when set (single-threaded otherwise)
+	bool packets = false; // Trace primary rays in PACKET_SIZE x PACKET_SIZE packets
+
+	// Output backend and the image pixels that fit in one terminal cell
+	Backend backend = Backend::Cells;
+	size_t cellWidth = 1, cellHeight = 1;
+	float pixelAspect = 0.5f; // Pixel width / height
+
+	// Internal render resolution as a fraction of the image (rays are traced at this scale, then upscaled)
+	float renderScale = 1.0f;
+	UpscaleFilter upscaleFilter = UpscaleFilter::Bilinear;
+	vector<Pixel> scaledPixels;
+
+	RayDirectionCache rayCache;
+
+	TemporalReuse reuse = TemporalReuse::Off;
+	PixelHistory history;
+
+	// Progressive anti-aliasing: samples per pixel to accumulate while the view holds still (1 = off)
+	size_t maxSamples = 1;
+	SampleAccumulator accumulator;
+
+	EdgeSampler edgeSampler;
+
+	// Deferred shading: trace into the G-buffer, then light it in a separate pass (forward shading with reflections or reuse)
+	bool deferred = false;
+	GBuffer gbuffer;
+
+	// Rays traced in the last frame
+	size_t primaryRays = 0;
+	size_t secondaryRays = 0; // Reflections
 
 	// Width is multiplied by 2 since we are using 2:1 tall rectangular pixels
-	Display3D(const size_t w, const size_t h, ncplane* p) : width{ w * 2 }, height{ h }, plane{ p } {
+	Display3D(const size_t w, const size_t h, PlaneOutput* o) : width{ w * 2 }, height{ h }, output{ o } {
 		// Initialize with black pixels
 		flattenedPixels.resize(width * height, Pixel{ 0, 0, 0 });
 	}
@@ -69,10 +431,137 @@ struct Display3D {
 		return width;
 	}
 
+	// Size of the image rays are traced at
+	size_t getRenderRows() const {
+		return max<size_t>(1, static_cast<size_t>(height * renderScale + 0.5f));
+	}
+
+	size_t getRenderCols() const {
+		return max<size_t>(1, static_cast<size_t>(width * renderScale + 0.5f));
+	}
+
+	// Stretch the scaled render over the whole image with the upscale filter
+	void upscale(const size_t renderWidth, const size_t renderHeight) {
+		if (upscaleFilter == UpscaleFilter::Nearest) {
+			for (size_t row = 0; row < height; ++row) {
+				const size_t srcRow = row * renderHeight / height;
+				for (size_t col = 0; col < width; ++col) {
+					pixelAt(row, col) = scaledPixels[srcRow * renderWidth + col * renderWidth / width];
+				}
+			}
+			return;
+		}
+
+		// Colors further apart than this (sum of channel differences) are treated as an edge
+		constexpr int EDGE_THRESHOLD = 96;
+
+		const float scaleX = static_cast<float>(renderWidth) / width;
+		const float scaleY = static_cast<float>(renderHeight) / height;
+		const auto src = [&](const size_t row, const size_t col) -> const Pixel& {
+			return scaledPixels[row * renderWidth + col];
+		};
+		const auto difference = [](const Pixel& a, const Pixel& b) {
+			return abs(a.r - b.r) + abs(a.g - b.g) + abs(a.b - b.b);
+		};
+
+		for (size_t row = 0; row < height; ++row) {
+			// Position of the pixel center in the render, relative to the centers of the surrounding render pixels
+			const float y = clamp((row + 0.5f) * scaleY - 0.5f, 0.0f, static_cast<float>(renderHeight - 1));
+			const size_t y0 = static_cast<size_t>(y);
+			const size_t y1 = min(y0 + 1, renderHeight - 1);
+			const float fy = y - y0;
+
+			for (size_t col = 0; col < width; ++col) {
+				const float x = clamp((col + 0.5f) * scaleX - 0.5f, 0.0f, static_cast<float>(renderWidth - 1));
+				const size_t x0 = static_cast<size_t>(x);
+				const size_t x1 = min(x0 + 1, renderWidth - 1);
+				const float fx = x - x0;
+
+				const Pixel& p00 = src(y0, x0);
+				const Pixel& p01 = src(y0, x1);
+				const Pixel& p10 = src(y1, x0);
+				const Pixel& p11 = src(y1, x1);
+
+				if (upscaleFilter == UpscaleFilter::EdgeAware) {
+					const int contrast = max(max(difference(p00, p01), difference(p00, p10)), max(difference(p00, p11), difference(p01, p10)));
+					if (contrast > EDGE_THRESHOLD) {
+						pixelAt(row, col) = src(fy < 0.5f ? y0 : y1, fx < 0.5f ? x0 : x1);
+						continue;
+					}
+				}
+
+				const float w00 = (1.0f - fx) * (1.0f - fy), w01 = fx * (1.0f - fy), w10 = (1.0f - fx) * fy, w11 = fx * fy;
+				pixelAt(row, col) = Pixel{
+					static_cast<u_char>(p00.r * w00 + p01.r * w01 + p10.r * w10 + p11.r * w11 + 0.5f),
+					static_cast<u_char>(p00.g * w00 + p01.g * w01 + p10.g * w10 + p11.g * w11 + 0.5f),
+					static_cast<u_char>(p00.b * w00 + p01.b * w01 + p10.b * w10 + p11.b * w11 + 0.5f)
+				};
+			}
+		}
+	}
+
+	// w and h are in units of 2 cells and 1 cell, like the constructor
 	void resize(const size_t w, const size_t h) {
-		width = w * 2;
-		height = h;
+		width = w * 2 * cellWidth;
+		height = h * cellHeight;
 		flattenedPixels.assign(width * height, Pixel{ 0, 0, 0 });
+		rayCache.invalidate();
+		history.invalidate();
+		accumulator.invalidate();
+		gbuffer.invalidate();
+		if (output) output->invalidate();
+	}
+
+	// Switch the output backend (call resize afterwards to apply the new cell geometry)
+	void setBackend(const Backend b, const size_t cellW, const size_t cellH, const float aspect) {
+		backend = b;
+		cellWidth = cellW;
+		cellHeight = cellH;
+		pixelAspect = aspect;
+	}
+
+	// Put the image on the terminal with the selected backend
+	void present(notcurses* nc) const {
+		if (backend == Backend::Cells) draw_image_to_plane();
+		else blit_image_to_plane(nc);
+	}
+
+	// Hand the whole image to notcurses as an RGBA visual and let the blitter pack several pixels into each cell
+	void blit_image_to_plane(notcurses* nc) const {
+		vector<uint32_t>& rgba = output->rgba;
+		rgba.resize(flattenedPixels.size());
+		for (size_t i = 0; i < flattenedPixels.size(); ++i) {
+			const Pixel& px = flattenedPixels[i];
+			const uint8_t bytes[4] = { px.r, px.g, px.b, 0xff };
+			memcpy(&rgba[i], bytes, sizeof(bytes));
+		}
+
+		ncvisual* visual = ncvisual_from_rgba(rgba.data(), height, width * sizeof(uint32_t), width);
+		if (!visual) return;
+
+		struct ncvisual_options vopts {};
+		vopts.scaling = NCSCALE_NONE;
+		switch (backend) {
+			case Backend::HalfBlock: vopts.blitter = NCBLIT_2x1; break;
+			case Backend::Quadrant:  vopts.blitter = NCBLIT_2x2; break;
+			case Backend::Sextant:   vopts.blitter = NCBLIT_3x2; break;
+			default:                 vopts.blitter = NCBLIT_PIXEL; break;
+		}
+
+		// The first blit creates a child plane (bitmaps can't go on the standard plane), later blits reuse it
+		if (output->visualPlane) {
+			vopts.n = output->visualPlane;
+		}
+		else {
+			vopts.n = output->plane;
+			vopts.flags = NCVISUAL_OPTION_CHILDPLANE;
+		}
+
+		ncplane* target = ncvisual_blit(nc, visual, &vopts);
+		if (!output->visualPlane) output->visualPlane = target;
+		ncvisual_destroy(visual);
+
+		output->cellsTouched = (width / cellWidth) * (height / cellHeight);
 	}
 
 	// Return a reference to the pixel we can modify
@@ -89,20 +578,52 @@ struct Display3D {
 		return row < height && col < width;
 	}
 
+	// Write the cells that changed since the last draw, one call per run of equally colored changed cells
 	void draw_image_to_plane() const {
+		PlaneOutput& out = *output;
+		const bool valid = out.presentedValid && out.presentedPixels.size() == flattenedPixels.size();
+		if (!valid) {
+			out.presentedPixels.assign(flattenedPixels.size(), Pixel{});
+			out.blanks.assign(width, ' '); // Using 2:1 tall rectangular pixels (space character)
+		}
+
+		out.cellsTouched = 0;
 		for (size_t row = 0; row < height; ++row) {
-			for (size_t col = 0; col < width; ++col) {
-				const Pixel& px = pixelAt(row, col);
+			const size_t rowOffset = row * width;
+			size_t col = 0;
+			while (col < width) {
+				const Pixel& px = flattenedPixels[rowOffset + col];
+				if (valid && px == out.presentedPixels[rowOffset + col]) {
+					++col;
+					continue;
+				}
 
-				// Set background and draw space to represent pixel
-				ncplane_set_bg_rgb8(plane, px.r, px.g, px.b);
-				ncplane_putstr_yx(plane, row, col, " "); // Using 2:1 tall rectangular pixels (space character)
+				// Extend the run while cells keep the same color and still need writing
+				size_t runEnd = col + 1;
+				while (runEnd < width && flattenedPixels[rowOffset + runEnd] == px
+					&& (!valid || out.presentedPixels[rowOffset + runEnd] != px)) {
+					++runEnd;
+				}
+
+				// Set background and draw spaces to represent the pixels
+				ncplane_set_bg_rgb8(out.plane, px.r, px.g, px.b);
+				ncplane_putnstr_yx(out.plane, row, col, runEnd - col, out.blanks.c_str());
+
+				fill(out.presentedPixels.begin() + rowOffset + col, out.presentedPixels.begin() + rowOffset + runEnd, px);
+				out.cellsTouched += runEnd - col;
+				col = runEnd;
 			}
 		}
+
+		out.presentedValid = true;
 	}
 
 	// Implemented later
-	void render_scene_to_image(const Camera& camera, const vector<unique_ptr<Object>>& objects, const vector<Light>& lights);
+	void render_scene_to_image(const Camera& camera, const Scene& scene);
+	void planReuse(const Camera& camera, const Scene& scene, size_t renderWidth, size_t renderHeight, float aspect, float planeWidth, float planeHeight);
+	bool refine(const Camera& camera, const Scene& scene, size_t renderWidth, size_t renderHeight, float aspect, float planeWidth, float planeHeight, vector<Pixel>& target);
+	void sampleEdges(const Camera& camera, const Scene& scene, size_t renderWidth, size_t renderHeight, float planeWidth, float planeHeight, vector<Pixel>& target);
+	void shadeGBuffer(const Camera& camera, const Scene& scene, size_t renderWidth, size_t renderHeight, vector<Pixel>& target);
 };
 
 //
@@ -159,6 +680,103 @@ struct Ray {
 	Ray(const Vec3& o, const Vec3& d_norm) : origin{ o }, direction{ d_norm } {}
 };
 
+// Axis aligned bounding box
+struct AABB {
+	Vec3 lower{ INFINITY, INFINITY, INFINITY };
+	Vec3 upper{ -INFINITY, -INFINITY, -INFINITY };
+
+	void grow(const Vec3& p) {
+		lower = Vec3{ min(lower.x, p.x), min(lower.y, p.y), min(lower.z, p.z) };
+		upper = Vec3{ max(upper.x, p.x), max(upper.y, p.y), max(upper.z, p.z) };
+	}
+
+	// Growing by an empty box changes nothing
+	void grow(const AABB& b) {
+		lower = Vec3{ min(lower.x, b.lower.x), min(lower.y, b.lower.y), min(lower.z, b.lower.z) };
+		upper = Vec3{ max(upper.x, b.upper.x), max(upper.y, b.upper.y), max(upper.z, b.upper.z) };
+	}
+
+	Vec3 centroid() const {
+		return (lower + upper) * 0.5f;
+	}
+
+	bool operator==(const AABB& b) const {
+		return lower.x == b.lower.x && lower.y == b.lower.y && lower.z == b.lower.z
+			&& upper.x == b.upper.x && upper.y == b.upper.y && upper.z == b.upper.z;
+	}
+
+	// Half the surface area (the constant factor doesn't matter for SAH comparisons)
+	float halfArea() const {
+		const Vec3 e = upper - lower;
+		if (e.x < 0.0f) return 0.0f; // Empty box
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	// Slab test against a ray with precomputed inverse direction (returns entry distance or INFINITY on a miss)
+	float intersect(const Vec3& origin, const Vec3& invDir, const float maxDist) const {
+		float tx1 = (lower.x - origin.x) * invDir.x, tx2 = (upper.x - origin.x) * invDir.x;
+		float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+		const float ty1 = (lower.y - origin.y) * invDir.y, ty2 = (upper.y - origin.y) * invDir.y;
+		tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+		const float tz1 = (lower.z - origin.z) * invDir.z, tz2 = (upper.z - origin.z) * invDir.z;
+		tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+
+		return (tmax >= tmin && tmax > 0.0f && tmin < maxDist) ? tmin : INFINITY;
+	}
+};
+
+// Affine transform: a linear part (one row per output axis) followed by a translation
+struct Transform {
+	Vec3 rows[3]{ Vec3{ 1, 0, 0 }, Vec3{ 0, 1, 0 }, Vec3{ 0, 0, 1 } };
+	Vec3 translation;
+
+	// Scale along x, y, z, then rotate about x, y, z (degrees), then translate
+	static Transform compose(const Vec3& scale, const Vec3& rotationDegrees, const Vec3& t) {
+		const float sx = sin(degToRad(rotationDegrees.x)), cx = cos(degToRad(rotationDegrees.x));
+		const float sy = sin(degToRad(rotationDegrees.y)), cy = cos(degToRad(rotationDegrees.y));
+		const float sz = sin(degToRad(rotationDegrees.z)), cz = cos(degToRad(rotationDegrees.z));
+
+		// Rz * Ry * Rx
+		const Vec3 r0{ cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx };
+		const Vec3 r1{ sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx };
+		const Vec3 r2{ -sy, cy * sx, cy * cx };
+
+		Transform transform;
+		transform.rows[0] = Vec3{ r0.x * scale.x, r0.y * scale.y, r0.z * scale.z };
+		transform.rows[1] = Vec3{ r1.x * scale.x, r1.y * scale.y, r1.z * scale.z };
+		transform.rows[2] = Vec3{ r2.x * scale.x, r2.y * scale.y, r2.z * scale.z };
+		transform.translation = t;
+		return transform;
+	}
+
+	Vec3 vector(const Vec3& v) const {
+		return Vec3{ rows[0].dot(v), rows[1].dot(v), rows[2].dot(v) };
+	}
+	Vec3 point(const Vec3& p) const {
+		return vector(p) + translation;
+	}
+	// Multiply by the transposed linear part (normals go to world space with the transposed inverse)
+	Vec3 transposedVector(const Vec3& v) const {
+		return rows[0] * v.x + rows[1] * v.y + rows[2] * v.z;
+	}
+
+	// Inverse of a transform with a non-zero scale
+	Transform inverse() const {
+		// Rows of the inverse are the cross products of the columns' complements, divided by the determinant
+		const Vec3 c0 = rows[1].cross(rows[2]);
+		const Vec3 c1 = rows[2].cross(rows[0]);
+		const Vec3 c2 = rows[0].cross(rows[1]);
+		const float invDet = 1.0f / rows[0].dot(c0);
+
+		Transform inv;
+		inv.rows[0] = Vec3{ c0.x, c1.x, c2.x } * invDet;
+		inv.rows[1] = Vec3{ c0.y, c1.y, c2.y } * invDet;
+		inv.rows[2] = Vec3{ c0.z, c1.z, c2.z } * invDet;
+		inv.translation = -inv.vector(translation);
+		return inv;
+	}
+};
+
 //
 // Lights, camera, action
 //
@@ -225,16 +843,36 @@ struct Object {
 	Vec3 center;
 	Pixel color;
 
+	// Material (only used when reflections are enabled)
+	float reflectivity = 0.0f; // Fraction of the color that comes from the reflection (1 = perfect mirror)
+	float roughness = 0.0f; // Random spread of reflected rays (0 = mirror, higher = glossier)
+
 	virtual ~Object() = default; // Prevent children from not being destroyed properly
 	Object(const Vec3& c, const Pixel& p) : center{ c }, color{ p } {}
 
 	virtual Vec3 getNormalAt(const Vec3& hitPoint) const = 0;
 	virtual bool intersects(const Ray& ray, float& dist) const = 0;
 
+	// Normal where the ray hits at dist (objects made of parts, like meshes, override this to find the part that was hit)
+	virtual Vec3 getHitNormal(const Ray& ray, const float dist) const {
+		return getNormalAt(ray.origin + ray.direction * dist);
+	}
+
+	// Set bounds to the world space bounding box (returns false for unbounded objects like planes)
+	virtual bool getBounds(AABB&) const {
+		return false;
+	}
+
 	// Default color getter (override for textured objects)
 	virtual const Pixel& getColorAt(const Vec3&) const {
 		return color;
 	}
+
+	// Any-hit query for shadow rays: whether the ray hits the object closer than maxDist
+	virtual bool occludes(const Ray& ray, const float maxDist) const {
+		float dist;
+		return intersects(ray, dist) && dist < maxDist;
+	}
 };
 
 struct Plane : public Object {
@@ -327,6 +965,19 @@ struct Box : public Object {
 		// return Vec3{ pU * a, pV * b, pW * c }.norm(); // Curved gradient
 	}
 
+	bool getBounds(AABB& bounds) const override {
+		// Half extent along each world axis is the sum of the projected half-lengths
+		const Vec3 extent{
+			abs(u.x) * hu + abs(v.x) * hv + abs(w.x) * hw,
+			abs(u.y) * hu + abs(v.y) * hv + abs(w.y) * hw,
+			abs(u.z) * hu + abs(v.z) * hv + abs(w.z) * hw
+		};
+		bounds = AABB{};
+		bounds.grow(center - extent);
+		bounds.grow(center + extent);
+		return true;
+	}
+
 	void calculateMinMax(const float h, const float o, const float d, float& minDist, float& maxDist) const {
 		minDist = (-h - o) / d;
 		maxDist = (h - o) / d;
@@ -368,6 +1019,13 @@ struct Sphere : public Object {
 		return (hitPoint - center).norm();
 	}
 
+	bool getBounds(AABB& bounds) const override {
+		bounds = AABB{};
+		bounds.grow(center - Vec3{ radius, radius, radius });
+		bounds.grow(center + Vec3{ radius, radius, radius });
+		return true;
+	}
+
 	// Check if a ray intersects with the sphere (dist is updated when intersection dist found)
 	bool intersects(const Ray& ray, float& dist) const override {
 		// Get the vector from the center of the sphere, to the ray's origin
@@ -388,223 +1046,3999 @@ struct Sphere : public Object {
 	}
 };
 
+// A copy of shared geometry placed by its own transform
+// Rays are moved into the geometry's space instead of the geometry into world space, so any number of instances
+// share one copy of the geometry (and a mesh's BVH) and only cost a transform each
+struct Instance : public Object {
+	std::shared_ptr<const Object> geometry;
+	std::string name; // Name of the geometry in scene files
 
-// Render the 3D scene to the image
-void Display3D::render_scene_to_image(const Camera& camera, const vector<unique_ptr<Object>>& objects, const vector<Light>& lights) {
-	// Calculate aspect ratio for proper scaling
-	// Divide width by 2 since we are using 2:1 tall rectangular pixels
-	const float aspect = (width * 0.5f) / static_cast<float>(height);
+	// Placement, call update() after changing it (then markMoved() and update() the scene)
+	Vec3 scale, rotation, translation; // Rotation in degrees about x, y, z
 
-	// Distance from camera to image plane
-	constexpr float camera_to_plane = 1.0f;
+	Transform toWorld, toLocal;
 
-	// Calculate the size of the image plane based on FOV and aspect ratio
-	const float plane_height = 2.0f * camera_to_plane * tan(degToRad(FOV * 0.5f));
-	const float plane_width = plane_height * aspect;
+	Instance(std::shared_ptr<const Object> g, std::string n, const Vec3& s, const Vec3& r, const Vec3& t)
+		: Object{ t, g->color }, geometry{ std::move(g) }, name{ std::move(n) }, scale{ s }, rotation{ r }, translation{ t } {
+		reflectivity = geometry->reflectivity;
+		roughness = geometry->roughness;
+		update();
+	}
 
-	// Get camera basis vectors
-	Vec3 forward, right, up;
-	camera.get_basis(forward, right, up);
+	void update() {
+		toWorld = Transform::compose(scale, rotation, translation);
+		toLocal = toWorld.inverse();
+		center = toWorld.point(geometry->center);
+	}
 
-	const float invWidth = 1.0f / static_cast<float>(width);
-	const float invHeight = 1.0f / static_cast<float>(height);
+	// The ray in geometry space, with a unit direction (distances along it are localScale times the world distance)
+	Ray localRay(const Ray& ray, float& localScale) const {
+		const Vec3 direction = toLocal.vector(ray.direction);
+		localScale = direction.length();
+		return Ray{ toLocal.point(ray.origin), direction.norm(localScale) };
+	}
 
-	// Cast rays for each pixel in the image
-	for (size_t row = 0; row < height; ++row) {
-		for (size_t col = 0; col < width; ++col) {
-			// Map pixel to world coordinates on the image plane
-			const float x = -((col + 0.5f) * invWidth - 0.5f) * plane_width; // Negate for correct orientation (flip)
-			const float y = ((row + 0.5f) * invHeight - 0.5f) * plane_height;
+	Vec3 worldNormal(const Vec3& localNormal) const {
+		return toLocal.transposedVector(localNormal).norm();
+	}
 
-			// Calculate pixel position in world space
-			const Vec3 pixelPos = camera.position + (forward * camera_to_plane) + (right * x) + (up * y);
+	bool intersects(const Ray& ray, float& dist) const override {
+		float localScale;
+		if (!geometry->intersects(localRay(ray, localScale), dist)) return false;
+		dist /= localScale;
+		return true;
+	}
 
-			// Create ray from camera to pixel
-			const Ray ray{ camera.position, (pixelPos - camera.position).norm() };
+	bool occludes(const Ray& ray, const float maxDist) const override {
+		float localScale;
+		const Ray local = localRay(ray, localScale);
+		return geometry->occludes(local, maxDist * localScale);
+	}
 
-			// Find closest object
-			float closest_dist = INFINITY;
-			const Object* closest_object = nullptr;
-			for (const auto& object : objects) {
-				float dist;
-				if (object->intersects(ray, dist) && dist < closest_dist) {
-					closest_dist = dist;
-					closest_object = object.get();
-				}
-			}
+	Vec3 getHitNormal(const Ray& ray, const float dist) const override {
+		float localScale;
+		const Ray local = localRay(ray, localScale);
+		return worldNormal(geometry->getHitNormal(local, dist * localScale));
+	}
 
-			// Closest object
-			if (closest_object) {
-				// Calculate the hit point and normal at the intersection
-				const Vec3 hitPoint = camera.position + ray.direction * closest_dist;
-				const Vec3 normal = closest_object->getNormalAt(hitPoint);
+	Vec3 getNormalAt(const Vec3& hitPoint) const override {
+		return worldNormal(geometry->getNormalAt(toLocal.point(hitPoint)));
+	}
 
-				const Pixel& surfaceColor = closest_object->getColorAt(hitPoint);
+	const Pixel& getColorAt(const Vec3& hitPoint) const override {
+		return geometry->getColorAt(toLocal.point(hitPoint));
+	}
 
-				// Accumulate the light sources onto the sphere
-				float rTotal = 0, gTotal = 0, bTotal = 0;
-				const float object_r_factor = surfaceColor.r / RGB_MAX_FLOAT;
-				const float object_g_factor = surfaceColor.g / RGB_MAX_FLOAT;
-				const float object_b_factor = surfaceColor.b / RGB_MAX_FLOAT;
-				for (const auto& light : lights) {
-					// Diffuse shading ( Lambertian reflectance)
-					const float diffuse = normal.dot(light.direction);
-					if (diffuse <= 0.0f) continue; // Only calculate if light is facing the surface
+	// Bounds of the transformed corners of the geometry's bounds
+	bool getBounds(AABB& bounds) const override {
+		AABB local;
+		if (!geometry->getBounds(local)) return false;
+
+		bounds = AABB{};
+		for (int corner = 0; corner < 8; ++corner) {
+			bounds.grow(toWorld.point(Vec3{
+				(corner & 1) ? local.upper.x : local.lower.x,
+				(corner & 2) ? local.upper.y : local.lower.y,
+				(corner & 4) ? local.upper.z : local.lower.z
+			}));
+		}
+		return true;
+	}
+};
 
-					// Diffuse color
-					rTotal += object_r_factor * diffuse * light.color.r;
-					gTotal += object_g_factor * diffuse * light.color.g;
-					bTotal += object_b_factor * diffuse * light.color.b;
+// Object types the hot loops call directly, so intersection and shading inline instead of going through virtual
+// functions. Objects of any other type (meshes, instances, new classes) still work through the virtual functions.
+enum class ObjectType : uint8_t {
+	Sphere,
+	Box,
+	Plane,
+	Checkerboard,
+	Other,
+};
 
-					// Specular shading (Blinn-Phong)
-					const Vec3 halfway = (light.direction - ray.direction).norm();
+// Exact type match, so subclasses of these types (which may override anything) take the virtual path
+ObjectType object_type(const Object& object) {
+	const std::type_info& type = typeid(object);
+	if (type == typeid(Sphere)) return ObjectType::Sphere;
+	if (type == typeid(Box)) return ObjectType::Box;
+	if (type == typeid(Plane)) return ObjectType::Plane;
+	if (type == typeid(CheckerboardPlane)) return ObjectType::Checkerboard;
+	return ObjectType::Other;
+}
 
-					const float specularAngle = max(0.0f, normal.dot(halfway));
-					const float specular = pow(specularAngle, SPECULAR_SHININESS);
+// Object::intersects without a virtual call for the closed set of types
+inline bool intersect_object(const ObjectType type, const Object& object, const Ray& ray, float& dist) {
+	switch (type) {
+		case ObjectType::Sphere: return static_cast<const Sphere&>(object).Sphere::intersects(ray, dist);
+		case ObjectType::Box: return static_cast<const Box&>(object).Box::intersects(ray, dist);
+		case ObjectType::Plane:
+		case ObjectType::Checkerboard: return static_cast<const Plane&>(object).Plane::intersects(ray, dist);
+		case ObjectType::Other: break;
+	}
+	return object.intersects(ray, dist);
+}
 
-					rTotal += specular * light.color.r;
-					gTotal += specular * light.color.g;
-					bTotal += specular * light.color.b;
-				}
+// Object::occludes (none of the closed set has its own any-hit test)
+inline bool occlude_object(const ObjectType type, const Object& object, const Ray& ray, const float maxDist) {
+	if (type == ObjectType::Other) return object.occludes(ray, maxDist);
+	float dist;
+	return intersect_object(type, object, ray, dist) && dist < maxDist;
+}
 
-				Pixel& pix = pixelAt(row, col);
-				pix.r = static_cast<u_char>(min(rTotal, RGB_MAX_FLOAT));
-				pix.g = static_cast<u_char>(min(gTotal, RGB_MAX_FLOAT));
-				pix.b = static_cast<u_char>(min(bTotal, RGB_MAX_FLOAT));
-			}
-		}
+// Object::getHitNormal
+inline Vec3 hit_normal(const ObjectType type, const Object& object, const Ray& ray, const float dist) {
+	const Vec3 hitPoint = ray.origin + ray.direction * dist;
+	switch (type) {
+		case ObjectType::Sphere: return static_cast<const Sphere&>(object).Sphere::getNormalAt(hitPoint);
+		case ObjectType::Box: return static_cast<const Box&>(object).Box::getNormalAt(hitPoint);
+		case ObjectType::Plane:
+		case ObjectType::Checkerboard: return static_cast<const Plane&>(object).Plane::getNormalAt(hitPoint);
+		case ObjectType::Other: break;
 	}
+	return object.getHitNormal(ray, dist);
 }
 
+// Object::getColorAt, by value so the plain colored types reduce to a load
+inline Pixel color_at(const ObjectType type, const Object& object, const Vec3& hitPoint) {
+	switch (type) {
+		case ObjectType::Sphere:
+		case ObjectType::Box:
+		case ObjectType::Plane: return object.color;
+		case ObjectType::Checkerboard: return static_cast<const CheckerboardPlane&>(object).CheckerboardPlane::getColorAt(hitPoint);
+		case ObjectType::Other: break;
+	}
+	return object.getColorAt(hitPoint);
+}
 
-// void draw_line_3d(Display3D& image, const Camera& camera, const Vec3& p0, const Vec3& p1, const Pixel& color) {
-// 	Vec3 forward, right, up;
-// 	get_camera_basis(camera, forward, right, up);
-// 	right = -right; // Invert right vector to match typical camera controls
-// 	up = -up; // Invert up vector to match typical camera controls
 
-// 	const size_t width = image.getNumCols();
-// 	const size_t height = image.getNumRows();
-// 	const float aspect = (width / 2.0f) / static_cast<float>(height);
-// 	constexpr float camera_to_plane = 1.0f;
-// 	const float plane_height = 2.0f * camera_to_plane * tan(degToRad(FOV * 0.5f));
-// 	const float plane_width = plane_height * aspect;
+//
+// Scene and acceleration structures
+//
 
-// 	auto project = [&](const Vec3& pt) -> pair<int, int> {
-// 		Vec3 cam_to_pt = pt - camera.position;
-// 		float z = forward.dot(cam_to_pt);
-// 		if (z <= 0.1f) return { -1, -1 }; // Behind camera
+// Closest hit found so far (ties go to the object that comes first in the scene, same as a linear search)
+struct Hit {
+	float dist = INFINITY;
+	const Object* object = nullptr;
+	uint32_t id = UINT32_MAX; // Index of the object in the scene
+
+	void consider(const Object* o, const uint32_t i, const float d) {
+		if (d < dist || (d == dist && i < id)) {
+			dist = d;
+			object = o;
+			id = i;
+		}
+	}
+};
 
-// 		float x = right.dot(cam_to_pt);
-// 		float y = up.dot(cam_to_pt);
+// Primary rays of a block of pixels that share the camera origin, traced together
+struct RayPacket {
+	static constexpr size_t MAX_RAYS = PACKET_SIZE * PACKET_SIZE;
+	static constexpr float FRUSTUM_MARGIN = 1e-3f; // Distance an object must be outside the frustum to be culled
+
+	Vec3 origin;
+	Vec3 directions[MAX_RAYS];
+	Vec3 invDirections[MAX_RAYS];
+	Hit hits[MAX_RAYS];
+	size_t count = 0;
+
+	// Corner rays and the inward facing planes through the origin they span (only for packets with 2+ rows and columns)
+	Vec3 corners[4];
+	Vec3 frustumNormals[4];
+	bool hasFrustum = false;
+
+	// Set up the rays (directions are row-major, numRows * numCols of them)
+	void init(const Vec3& o, const size_t numRows, const size_t numCols) {
+		origin = o;
+		count = numRows * numCols;
+		for (size_t i = 0; i < count; ++i) {
+			hits[i] = Hit{};
+			invDirections[i] = Vec3{ 1.0f / directions[i].x, 1.0f / directions[i].y, 1.0f / directions[i].z };
+		}
 
-// 		// Perspective divide
-// 		float px = (x / z) * camera_to_plane;
-// 		float py = (y / z) * camera_to_plane;
+		hasFrustum = numRows > 1 && numCols > 1;
+		if (!hasFrustum) return;
+
+		corners[0] = directions[0];
+		corners[1] = directions[numCols - 1];
+		corners[2] = directions[count - 1];
+		corners[3] = directions[count - numCols];
+		const Vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+		for (size_t i = 0; i < 4; ++i) {
+			Vec3 normal = corners[i].cross(corners[(i + 1) % 4]).norm();
+			if (normal.dot(center) < 0.0f) normal = -normal;
+			frustumNormals[i] = normal;
+		}
+	}
 
-// 		int col = static_cast<int>((0.5f + px / plane_width) * width);
-// 		int row = static_cast<int>((0.5f - py / plane_height) * height);
-// 		return { row, col };
-// 		};
+	Ray ray(const size_t i) const {
+		return Ray{ origin, directions[i] };
+	}
 
-// 	auto [row0, col0] = project(p0);
-// 	auto [row1, col1] = project(p1);
+	// True if the box is entirely outside one of the frustum planes (no ray in the packet can hit it)
+	bool outsideFrustum(const AABB& box) const {
+		if (!hasFrustum) return false;
+		for (const Vec3& n : frustumNormals) {
+			// Corner of the box furthest along the normal
+			const Vec3 farthest{
+				n.x >= 0.0f ? box.upper.x : box.lower.x,
+				n.y >= 0.0f ? box.upper.y : box.lower.y,
+				n.z >= 0.0f ? box.upper.z : box.lower.z
+			};
+			if (n.dot(farthest - origin) < -FRUSTUM_MARGIN) return true;
+		}
+		return false;
+	}
+};
 
-// 	// Simple Bresenham's line algorithm
-// 	if (row0 >= 0 && col0 >= 0 && row1 >= 0 && col1 >= 0 &&
+// Bounding volume hierarchy over bounded objects, built with binned SAH and flattened into one node array
+struct BVH {
+	static constexpr size_t SAH_BINS = 16;
+	static constexpr size_t MAX_DEPTH = 60; // Keeps traversal within its fixed size stack
+	static constexpr size_t STACK_SIZE = 64;
+
+	struct Node {
+		AABB bounds;
+		uint32_t first; // First primitive for leaves, left child for interior nodes (right child is first + 1)
+		uint32_t count; // Number of primitives (0 for interior nodes)
+	};
+
+	struct Primitive {
+		const Object* object;
+		uint32_t id; // Index of the object in the scene
+		ObjectType type;
+	};
+
+	vector<Node> nodes;
+	vector<Primitive> primitives; // Sorted so every leaf references a contiguous range
+
+	// For refitting after primitives move (only kept by build(), not buildNodes())
+	vector<uint32_t> parents; // Parent of every node (UINT32_MAX for the root)
+	vector<uint32_t> leafOf; // Leaf holding each primitive, by primitive id (UINT32_MAX for ids not in the tree)
+	size_t height = 0; // Depth of the deepest leaf
+	double cost = 0.0; // Sum of the nodes' SAH terms (see nodeCost), kept up to date by refits
+	double builtCost = 0.0; // Cost right after the build
+
+	void clear() {
+		nodes.clear();
+		primitives.clear();
+		parents.clear();
+		leafOf.clear();
+		height = 0;
+		cost = builtCost = 0.0;
+	}
+
+	bool empty() const {
+		return nodes.empty();
+	}
+
+	void build(vector<Primitive> prims) {
+		clear();
+		primitives = std::move(prims);
+		if (primitives.empty()) return;
+
+		vector<AABB> bounds(primitives.size());
+		for (size_t i = 0; i < primitives.size(); ++i) primitives[i].object->getBounds(bounds[i]);
+		vector<uint32_t> order;
+		buildNodes(bounds, order);
+
+		// Reorder primitives into leaf order
+		vector<Primitive> sorted(primitives.size());
+		for (size_t i = 0; i < order.size(); ++i) sorted[i] = primitives[order[i]];
+		primitives = std::move(sorted);
+
+		linkNodes();
+		builtCost = cost;
+	}
+
+	// Build only the nodes, over items with the given bounds (for structures that keep their own primitives, like meshes)
+	// order receives the item indices in leaf order, leaves reference ranges of it
+	void buildNodes(const vector<AABB>& bounds, vector<uint32_t>& order) {
+		nodes.clear();
+		order.resize(bounds.size());
+		if (bounds.empty()) return;
+
+		// The build partitions copies of the bounds in place, so every level reads memory in order
+		vector<BuildItem> items(bounds.size());
+		for (size_t i = 0; i < bounds.size(); ++i) items[i] = BuildItem{ bounds[i], bounds[i].centroid(), static_cast<uint32_t>(i) };
+
+		nodes.reserve(2 * bounds.size());
+		nodes.push_back(Node{ AABB{}, 0, static_cast<uint32_t>(bounds.size()) });
+		subdivide(0, 0, items);
+		for (size_t i = 0; i < items.size(); ++i) order[i] = items[i].index;
+	}
+
+	// Fit all node bounds to the primitives' current bounds, keeping the tree
+	// Much cheaper than a build after objects move, but traversal slows down as they drift from where the tree was built
+	void refit() {
+		// Children always come after their parent, so a backwards sweep fits them first
+		cost = 0.0;
+		for (size_t n = nodes.size(); n-- > 0;) {
+			nodes[n].bounds = fitNode(nodes[n]);
+			cost += nodeCost(nodes[n]);
+		}
+	}
+
+	// Fit the leaf holding one moved primitive and its ancestors, O(depth)
+	// Stops at the first node whose bounds didn't change (nodes above it can't have changed either)
+	void refitPrimitive(const uint32_t id) {
+		uint32_t n = id < leafOf.size() ? leafOf[id] : UINT32_MAX;
+		while (n != UINT32_MAX) {
+			Node& node = nodes[n];
+			const AABB bounds = fitNode(node);
+			if (bounds == node.bounds) break;
+
+			cost -= nodeCost(node);
+			node.bounds = bounds;
+			cost += nodeCost(node);
+			n = parents[n];
+		}
+	}
+
+	// How much the tree degraded since the build: 1 right after it, growing as refit bounds loosen and overlap
+	// (not relative to the root area, so a few objects flying away from the rest can't hide the loosened nodes)
+	double degradation() const {
+		return builtCost > 0.0 ? cost / builtCost : 1.0;
+	}
+
+	// Find the closest primitive hit by the ray in the subtree under startNode (hit.dist limits the search)
+	void closestHit(const Ray& ray, Hit& hit, const uint32_t startNode = 0) const {
+		if (nodes.empty()) return;
+
+		const Vec3 invDir{ 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+		uint32_t stack[STACK_SIZE];
+		size_t stackSize = 0;
+		if (nodes[startNode].bounds.intersect(ray.origin, invDir, hit.dist) == INFINITY) return;
+		stack[stackSize++] = startNode;
+
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+					float dist;
+					const Primitive& prim = primitives[i];
+					if (intersect_object(prim.type, *prim.object, ray, dist)) hit.consider(prim.object, prim.id, dist);
+				}
+				continue;
+			}
+
+			// Visit the nearer child first (pushed last)
+			uint32_t nearChild = node.first, farChild = node.first + 1;
+			float nearDist = nodes[nearChild].bounds.intersect(ray.origin, invDir, hit.dist);
+			float farDist = nodes[farChild].bounds.intersect(ray.origin, invDir, hit.dist);
+			if (farDist < nearDist) {
+				swap(nearChild, farChild);
+				swap(nearDist, farDist);
+			}
+
+			if (farDist != INFINITY) stack[stackSize++] = farChild;
+			if (nearDist != INFINITY) stack[stackSize++] = nearChild;
+		}
+	}
+
+	// Return an object the ray hits closer than maxDist, or null
+	// Any hit will do, so children are visited in any order and the traversal stops at the first hit
+	const Object* anyHit(const Ray& ray, const float maxDist) const {
+		if (nodes.empty()) return nullptr;
+
+		const Vec3 invDir{ 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+		uint32_t stack[STACK_SIZE];
+		size_t stackSize = 0;
+		if (nodes[0].bounds.intersect(ray.origin, invDir, maxDist) == INFINITY) return nullptr;
+		stack[stackSize++] = 0;
+
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+					if (occlude_object(primitives[i].type, *primitives[i].object, ray, maxDist)) return primitives[i].object;
+				}
+				continue;
+			}
+
+			for (const uint32_t child : { node.first, node.first + 1 }) {
+				if (nodes[child].bounds.intersect(ray.origin, invDir, maxDist) != INFINITY) stack[stackSize++] = child;
+			}
+		}
+		return nullptr;
+	}
+
+	// Find the closest hits for a packet of rays
+	// Nodes outside the packet frustum are skipped for all rays at once, and once fewer than a quarter of the rays
+	// still hit a node the packet has diverged and the remaining rays finish that subtree one at a time
+	void closestHitPacket(RayPacket& packet) const {
+		if (nodes.empty()) return;
+
+		uint32_t stack[STACK_SIZE];
+		size_t stackSize = 0;
+		stack[stackSize++] = 0;
+
+		bool active[RayPacket::MAX_RAYS];
+		while (stackSize > 0) {
+			const uint32_t nodeIndex = stack[--stackSize];
+			const Node& node = nodes[nodeIndex];
+			if (packet.outsideFrustum(node.bounds)) continue;
+
+			size_t activeCount = 0;
+			for (size_t i = 0; i < packet.count; ++i) {
+				active[i] = node.bounds.intersect(packet.origin, packet.invDirections[i], packet.hits[i].dist) != INFINITY;
+				activeCount += active[i];
+			}
+			if (activeCount == 0) continue;
+
+			if (activeCount * 4 < packet.count) {
+				for (size_t i = 0; i < packet.count; ++i) {
+					if (active[i]) closestHit(packet.ray(i), packet.hits[i], nodeIndex);
+				}
+				continue;
+			}
+
+			if (node.count > 0) {
+				for (uint32_t p = node.first; p < node.first + node.count; ++p) {
+					const Primitive& prim = primitives[p];
+					for (size_t i = 0; i < packet.count; ++i) {
+						float dist;
+						if (active[i] && intersect_object(prim.type, *prim.object, packet.ray(i), dist)) packet.hits[i].consider(prim.object, prim.id, dist);
+					}
+				}
+				continue;
+			}
+
+			// Visit the child closer to the camera first (pushed last)
+			uint32_t nearChild = node.first, farChild = node.first + 1;
+			const Vec3 toNear = nodes[nearChild].bounds.centroid() - packet.origin;
+			const Vec3 toFar = nodes[farChild].bounds.centroid() - packet.origin;
+			if (toFar.dot(toFar) < toNear.dot(toNear)) swap(nearChild, farChild);
+
+			stack[stackSize++] = farChild;
+			stack[stackSize++] = nearChild;
+		}
+	}
+
+private:
+	struct BuildItem {
+		AABB bounds;
+		Vec3 centroid;
+		uint32_t index; // Position in the bounds the build started from
+	};
+
+	void subdivide(const uint32_t nodeIndex, const size_t depth, vector<BuildItem>& items) {
+		Node& node = nodes[nodeIndex];
+
+		// Fit the node and its centroids
+		AABB centroidBounds;
+		node.bounds = AABB{};
+		for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+			node.bounds.grow(items[i].bounds);
+			centroidBounds.grow(items[i].centroid);
+		}
+
+		if (node.count <= 2 || depth >= MAX_DEPTH) return;
+
+		// Find the cheapest split plane by binning centroids along each axis
+		const float leafCost = node.bounds.halfArea() * node.count;
+
+		// Small nodes use fewer bins (the sweep over the bins would cost more than binning their primitives)
+		const size_t numBins = min(SAH_BINS, max<size_t>(4, node.count));
+		float bestCost = leafCost;
+		int bestAxis = -1;
+		size_t bestSplit = 0;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			const float lo = axisOf(centroidBounds.lower, axis);
+			const float hi = axisOf(centroidBounds.upper, axis);
+			if (hi <= lo) continue; // All centroids on one plane
+
+			AABB binBounds[SAH_BINS];
+			size_t binCounts[SAH_BINS] = {};
+			const float scale = numBins / (hi - lo);
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				const size_t bin = min(numBins - 1, static_cast<size_t>((axisOf(items[i].centroid, axis) - lo) * scale));
+				binBounds[bin].grow(items[i].bounds);
+				++binCounts[bin];
+			}
+
+			// Sweep from both sides to get the area and count left and right of every split
+			float leftArea[SAH_BINS - 1], rightArea[SAH_BINS - 1];
+			size_t leftCount[SAH_BINS - 1], rightCount[SAH_BINS - 1];
+			AABB leftBox, rightBox;
+			size_t leftSum = 0, rightSum = 0;
+			for (size_t i = 0; i < numBins - 1; ++i) {
+				leftSum += binCounts[i];
+				leftCount[i] = leftSum;
+				leftBox.grow(binBounds[i]);
+				leftArea[i] = leftBox.halfArea();
+
+				rightSum += binCounts[numBins - 1 - i];
+				rightCount[numBins - 2 - i] = rightSum;
+				rightBox.grow(binBounds[numBins - 1 - i]);
+				rightArea[numBins - 2 - i] = rightBox.halfArea();
+			}
+
+			for (size_t i = 0; i < numBins - 1; ++i) {
+				if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+				const float cost = leftArea[i] * leftCount[i] + rightArea[i] * rightCount[i];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		if (bestAxis == -1) return; // Splitting is no cheaper than a leaf
+
+		// Partition primitives around the split plane
+		const float lo = axisOf(centroidBounds.lower, bestAxis);
+		const float scale = numBins / (axisOf(centroidBounds.upper, bestAxis) - lo);
+		const auto middle = std::partition(items.begin() + node.first, items.begin() + node.first + node.count, [&](const BuildItem& item) {
+			return min(numBins - 1, static_cast<size_t>((axisOf(item.centroid, bestAxis) - lo) * scale)) <= bestSplit;
+		});
+		const uint32_t leftCount = static_cast<uint32_t>(middle - items.begin()) - node.first;
+
+		// Children are allocated next to each other (references into nodes are invalid after push_back)
+		const uint32_t first = node.first, count = node.count;
+		const uint32_t leftChild = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(Node{ AABB{}, first, leftCount });
+		nodes.push_back(Node{ AABB{}, first + leftCount, count - leftCount });
+		nodes[nodeIndex].first = leftChild;
+		nodes[nodeIndex].count = 0;
+
+		subdivide(leftChild, depth + 1, items);
+		subdivide(leftChild + 1, depth + 1, items);
+	}
+
+	static float axisOf(const Vec3& v, const int axis) {
+		return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+	}
+
+	// SAH term of a node: its area times the primitives tested in a leaf, or one traversal step for interior nodes
+	static double nodeCost(const Node& node) {
+		return static_cast<double>(node.bounds.halfArea()) * max<uint32_t>(node.count, 1);
+	}
+
+	// Bounds of a node's primitives (leaves) or children (interior nodes)
+	AABB fitNode(const Node& node) const {
+		AABB fitted;
+		if (node.count == 0) {
+			fitted.grow(nodes[node.first].bounds);
+			fitted.grow(nodes[node.first + 1].bounds);
+			return fitted;
+		}
+
+		AABB bounds;
+		for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+			primitives[i].object->getBounds(bounds);
+			fitted.grow(bounds);
+		}
+		return fitted;
+	}
+
+	// Find the parents, the leaf of every primitive, the height, and the cost of a freshly built tree
+	void linkNodes() {
+		uint32_t maxId = 0;
+		for (const Primitive& prim : primitives) maxId = max(maxId, prim.id);
+		leafOf.assign(primitives.empty() ? 0 : maxId + 1, UINT32_MAX);
+		parents.assign(nodes.size(), UINT32_MAX);
+
+		// Parents come before their children, so depths are known by the time a node is reached
+		vector<uint32_t> depths(nodes.size(), 0);
+		height = 0;
+		cost = 0.0;
+		for (uint32_t n = 0; n < nodes.size(); ++n) {
+			const Node& node = nodes[n];
+			cost += nodeCost(node);
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) leafOf[primitives[i].id] = n;
+				height = max<size_t>(height, depths[n]);
+				continue;
+			}
+			for (const uint32_t child : { node.first, node.first + 1 }) {
+				parents[child] = n;
+				depths[child] = depths[n] + 1;
+			}
+		}
+	}
+};
+
+// Indexed triangle mesh with its own BVH over the triangles, which sits as one bounded object under the scene BVH
+// Triangles are stored as a vertex and two edges in the BVH's leaf order and intersected with Moller-Trumbore.
+// Faces are flat shaded and lit from whichever side the ray comes from.
+struct Mesh : public Object {
+	struct Triangle {
+		Vec3 v0, e1, e2; // e1 = v1 - v0, e2 = v2 - v0
+	};
+
+	std::string path; // File the mesh was loaded from (written back when saving scenes)
+	vector<Triangle> triangles;
+	BVH blas; // Nodes over the triangles (its primitives stay empty)
+	AABB bounds;
+
+	// Three vertex indices per triangle (out of range indices and degenerate triangles are dropped)
+	Mesh(const vector<Vec3>& vertices, const vector<uint32_t>& indices, const Pixel& p) : Object{ Vec3{}, p } {
+		vector<Triangle> unsorted;
+		vector<AABB> triangleBounds;
+		unsorted.reserve(indices.size() / 3);
+		triangleBounds.reserve(indices.size() / 3);
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			if (indices[i] >= vertices.size() || indices[i + 1] >= vertices.size() || indices[i + 2] >= vertices.size()) continue;
+			const Vec3& v0 = vertices[indices[i]];
+			const Vec3& v1 = vertices[indices[i + 1]];
+			const Vec3& v2 = vertices[indices[i + 2]];
+			const Triangle triangle{ v0, v1 - v0, v2 - v0 };
+			const Vec3 area = triangle.e1.cross(triangle.e2);
+			if (area.x == 0.0f && area.y == 0.0f && area.z == 0.0f) continue;
+
+			AABB box;
+			box.grow(v0);
+			box.grow(v1);
+			box.grow(v2);
+			unsorted.push_back(triangle);
+			triangleBounds.push_back(box);
+			bounds.grow(box);
+		}
+
+		vector<uint32_t> order;
+		blas.buildNodes(triangleBounds, order);
+		triangles.resize(unsorted.size());
+		for (size_t i = 0; i < order.size(); ++i) triangles[i] = unsorted[order[i]];
+		center = bounds.centroid();
+	}
+
+	bool getBounds(AABB& b) const override {
+		b = bounds;
+		return !triangles.empty();
+	}
+
+	bool intersects(const Ray& ray, float& dist) const override {
+		uint32_t triangle;
+		dist = INFINITY;
+		return trace(ray, dist, triangle, false);
+	}
+
+	bool occludes(const Ray& ray, const float maxDist) const override {
+		float dist = maxDist;
+		uint32_t triangle;
+		return trace(ray, dist, triangle, true);
+	}
+
+	// Trace the ray again to find the triangle it hit (the same ray finds the same closest triangle)
+	Vec3 getHitNormal(const Ray& ray, const float) const override {
+		float dist = INFINITY;
+		uint32_t triangle = 0;
+		trace(ray, dist, triangle, false);
+		return faceNormal(triangle, ray.direction);
+	}
+
+	// Normal of the triangle closest to the point (only for callers without the ray)
+	Vec3 getNormalAt(const Vec3& hitPoint) const override {
+		float best = INFINITY;
+		uint32_t closest = 0;
+		for (uint32_t i = 0; i < triangles.size(); ++i) {
+			const Triangle& t = triangles[i];
+			const float distance = abs((hitPoint - t.v0).dot(t.e1.cross(t.e2).norm()));
+			if (distance < best && inside(t, hitPoint)) {
+				best = distance;
+				closest = i;
+			}
+		}
+		return faceNormal(closest, Vec3{ 0, 0, 0 });
+	}
+
+private:
+	// Closest hit closer than dist (any hit when anyHit is set), updating dist and the triangle index
+	bool trace(const Ray& ray, float& dist, uint32_t& triangle, const bool anyHit) const {
+		if (blas.empty()) return false;
+
+		const Vec3 invDir{ 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+		uint32_t stack[BVH::STACK_SIZE];
+		size_t stackSize = 0;
+		if (blas.nodes[0].bounds.intersect(ray.origin, invDir, dist) == INFINITY) return false;
+		stack[stackSize++] = 0;
+
+		bool found = false;
+		while (stackSize > 0) {
+			const BVH::Node& node = blas.nodes[stack[--stackSize]];
+
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+					float d;
+					if (intersectTriangle(triangles[i], ray, d) && d < dist) {
+						dist = d;
+						triangle = i;
+						found = true;
+						if (anyHit) return true;
+					}
+				}
+				continue;
+			}
+
+			// Visit the nearer child first (pushed last)
+			uint32_t nearChild = node.first, farChild = node.first + 1;
+			float nearDist = blas.nodes[nearChild].bounds.intersect(ray.origin, invDir, dist);
+			float farDist = blas.nodes[farChild].bounds.intersect(ray.origin, invDir, dist);
+			if (farDist < nearDist) {
+				swap(nearChild, farChild);
+				swap(nearDist, farDist);
+			}
+
+			if (farDist != INFINITY) stack[stackSize++] = farChild;
+			if (nearDist != INFINITY) stack[stackSize++] = nearChild;
+		}
+		return found;
+	}
+
+	static bool intersectTriangle(const Triangle& t, const Ray& ray, float& dist) {
+		const Vec3 p = ray.direction.cross(t.e2);
+		const float det = t.e1.dot(p);
+		if (det == 0.0f) return false; // Parallel to the triangle
+		const float invDet = 1.0f / det;
+
+		const Vec3 s = ray.origin - t.v0;
+		const float u = s.dot(p) * invDet;
+		if (u < 0.0f || u > 1.0f) return false;
+
+		const Vec3 q = s.cross(t.e1);
+		const float v = ray.direction.dot(q) * invDet;
+		if (v < 0.0f || u + v > 1.0f) return false;
+
+		dist = t.e2.dot(q) * invDet;
+		return dist > 0.0f;
+	}
+
+	// Whether the point projects into the triangle (with some slack for rounding)
+	static bool inside(const Triangle& t, const Vec3& point) {
+		constexpr float SLACK = 1e-3f;
+		const Vec3 n = t.e1.cross(t.e2);
+		const Vec3 s = point - t.v0;
+		const float invArea = 1.0f / n.dot(n);
+		const float u = s.cross(t.e2).dot(n) * invArea;
+		const float v = t.e1.cross(s).dot(n) * invArea;
+		return u >= -SLACK && v >= -SLACK && u + v <= 1.0f + SLACK;
+	}
+
+	// Face normal, turned against the ray direction
+	Vec3 faceNormal(const uint32_t triangle, const Vec3& direction) const {
+		if (triangles.empty()) return Vec3{ 0, 0, 0 };
+		const Triangle& t = triangles[triangle];
+		const Vec3 normal = t.e1.cross(t.e2).norm();
+		return normal.dot(direction) > 0.0f ? -normal : normal;
+	}
+};
+
+// Float vector of the widest width the target supports (AVX-512: 16, AVX: 8, SSE: 4, otherwise scalar)
+// Comparisons return a MaskN of lanes where the comparison holds (false for NaN lanes, same as scalar floats)
+#if defined(__AVX512F__)
+struct MaskN {
+	__mmask16 m;
+	MaskN operator&(const MaskN o) const { return MaskN{ static_cast<__mmask16>(m & o.m) }; }
+	unsigned bits() const { return m; }
+};
+struct FloatN {
+	static constexpr size_t WIDTH = 16;
+	__m512 v;
+	FloatN(const __m512 x) : v{ x } {}
+	explicit FloatN(const float x) : v{ _mm512_set1_ps(x) } {}
+	static FloatN load(const float* p) { return FloatN{ _mm512_load_ps(p) }; }
+	static FloatN loadUnaligned(const float* p) { return FloatN{ _mm512_loadu_ps(p) }; }
+	void store(float* p) const { _mm512_store_ps(p, v); }
+	FloatN operator+(const FloatN o) const { return FloatN{ _mm512_add_ps(v, o.v) }; }
+	FloatN operator-(const FloatN o) const { return FloatN{ _mm512_sub_ps(v, o.v) }; }
+	FloatN operator*(const FloatN o) const { return FloatN{ _mm512_mul_ps(v, o.v) }; }
+	FloatN operator/(const FloatN o) const { return FloatN{ _mm512_div_ps(v, o.v) }; }
+	FloatN operator-() const { return FloatN{ _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(v), _mm512_set1_epi32(INT32_MIN))) }; }
+	MaskN operator<(const FloatN o) const { return MaskN{ _mm512_cmp_ps_mask(v, o.v, _CMP_LT_OQ) }; }
+	MaskN operator<=(const FloatN o) const { return MaskN{ _mm512_cmp_ps_mask(v, o.v, _CMP_LE_OQ) }; }
+	MaskN operator>(const FloatN o) const { return MaskN{ _mm512_cmp_ps_mask(v, o.v, _CMP_GT_OQ) }; }
+	MaskN operator>=(const FloatN o) const { return MaskN{ _mm512_cmp_ps_mask(v, o.v, _CMP_GE_OQ) }; }
+};
+inline FloatN sqrt(const FloatN a) { return FloatN{ _mm512_sqrt_ps(a.v) }; }
+inline FloatN select(const MaskN m, const FloatN a, const FloatN b) { return FloatN{ _mm512_mask_blend_ps(m.m, b.v, a.v) }; }
+#elif defined(__AVX__)
+struct MaskN {
+	__m256 m;
+	MaskN operator&(const MaskN o) const { return MaskN{ _mm256_and_ps(m, o.m) }; }
+	unsigned bits() const { return static_cast<unsigned>(_mm256_movemask_ps(m)); }
+};
+struct FloatN {
+	static constexpr size_t WIDTH = 8;
+	__m256 v;
+	FloatN(const __m256 x) : v{ x } {}
+	explicit FloatN(const float x) : v{ _mm256_set1_ps(x) } {}
+	static FloatN load(const float* p) { return FloatN{ _mm256_load_ps(p) }; }
+	static FloatN loadUnaligned(const float* p) { return FloatN{ _mm256_loadu_ps(p) }; }
+	void store(float* p) const { _mm256_store_ps(p, v); }
+	FloatN operator+(const FloatN o) const { return FloatN{ _mm256_add_ps(v, o.v) }; }
+	FloatN operator-(const FloatN o) const { return FloatN{ _mm256_sub_ps(v, o.v) }; }
+	FloatN operator*(const FloatN o) const { return FloatN{ _mm256_mul_ps(v, o.v) }; }
+	FloatN operator/(const FloatN o) const { return FloatN{ _mm256_div_ps(v, o.v) }; }
+	FloatN operator-() const { return FloatN{ _mm256_xor_ps(v, _mm256_set1_ps(-0.0f)) }; }
+	MaskN operator<(const FloatN o) const { return MaskN{ _mm256_cmp_ps(v, o.v, _CMP_LT_OQ) }; }
+	MaskN operator<=(const FloatN o) const { return MaskN{ _mm256_cmp_ps(v, o.v, _CMP_LE_OQ) }; }
+	MaskN operator>(const FloatN o) const { return MaskN{ _mm256_cmp_ps(v, o.v, _CMP_GT_OQ) }; }
+	MaskN operator>=(const FloatN o) const { return MaskN{ _mm256_cmp_ps(v, o.v, _CMP_GE_OQ) }; }
+};
+inline FloatN sqrt(const FloatN a) { return FloatN{ _mm256_sqrt_ps(a.v) }; }
+inline FloatN select(const MaskN m, const FloatN a, const FloatN b) { return FloatN{ _mm256_blendv_ps(b.v, a.v, m.m) }; }
+#elif defined(__SSE2__)
+struct MaskN {
+	__m128 m;
+	MaskN operator&(const MaskN o) const { return MaskN{ _mm_and_ps(m, o.m) }; }
+	unsigned bits() const { return static_cast<unsigned>(_mm_movemask_ps(m)); }
+};
+struct FloatN {
+	static constexpr size_t WIDTH = 4;
+	__m128 v;
+	FloatN(const __m128 x) : v{ x } {}
+	explicit FloatN(const float x) : v{ _mm_set1_ps(x) } {}
+	static FloatN load(const float* p) { return FloatN{ _mm_load_ps(p) }; }
+	static FloatN loadUnaligned(const float* p) { return FloatN{ _mm_loadu_ps(p) }; }
+	void store(float* p) const { _mm_store_ps(p, v); }
+	FloatN operator+(const FloatN o) const { return FloatN{ _mm_add_ps(v, o.v) }; }
+	FloatN operator-(const FloatN o) const { return FloatN{ _mm_sub_ps(v, o.v) }; }
+	FloatN operator*(const FloatN o) const { return FloatN{ _mm_mul_ps(v, o.v) }; }
+	FloatN operator/(const FloatN o) const { return FloatN{ _mm_div_ps(v, o.v) }; }
+	FloatN operator-() const { return FloatN{ _mm_xor_ps(v, _mm_set1_ps(-0.0f)) }; }
+	MaskN operator<(const FloatN o) const { return MaskN{ _mm_cmplt_ps(v, o.v) }; }
+	MaskN operator<=(const FloatN o) const { return MaskN{ _mm_cmple_ps(v, o.v) }; }
+	MaskN operator>(const FloatN o) const { return MaskN{ _mm_cmpgt_ps(v, o.v) }; }
+	MaskN operator>=(const FloatN o) const { return MaskN{ _mm_cmpge_ps(v, o.v) }; }
+};
+inline FloatN sqrt(const FloatN a) { return FloatN{ _mm_sqrt_ps(a.v) }; }
+inline FloatN select(const MaskN m, const FloatN a, const FloatN b) { return FloatN{ _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)) }; }
+#else
+struct MaskN {
+	bool m;
+	MaskN operator&(const MaskN o) const { return MaskN{ m && o.m }; }
+	unsigned bits() const { return m ? 1u : 0u; }
+};
+struct FloatN {
+	static constexpr size_t WIDTH = 1;
+	float v;
+	explicit FloatN(const float x) : v{ x } {}
+	static FloatN load(const float* p) { return FloatN{ *p }; }
+	static FloatN loadUnaligned(const float* p) { return FloatN{ *p }; }
+	void store(float* p) const { *p = v; }
+	FloatN operator+(const FloatN o) const { return FloatN{ v + o.v }; }
+	FloatN operator-(const FloatN o) const { return FloatN{ v - o.v }; }
+	FloatN operator*(const FloatN o) const { return FloatN{ v * o.v }; }
+	FloatN operator/(const FloatN o) const { return FloatN{ v / o.v }; }
+	FloatN operator-() const { return FloatN{ -v }; }
+	MaskN operator<(const FloatN o) const { return MaskN{ v < o.v }; }
+	MaskN operator<=(const FloatN o) const { return MaskN{ v <= o.v }; }
+	MaskN operator>(const FloatN o) const { return MaskN{ v > o.v }; }
+	MaskN operator>=(const FloatN o) const { return MaskN{ v >= o.v }; }
+};
+inline FloatN sqrt(const FloatN a) { return FloatN{ std::sqrt(a.v) }; }
+inline FloatN select(const MaskN m, const FloatN a, const FloatN b) { return m.m ? a : b; }
+#endif
+
+// Same results as std::max/std::min (the second argument is only taken when the comparison holds)
+inline FloatN maxN(const FloatN a, const FloatN b) { return select(a < b, b, a); }
+inline FloatN minN(const FloatN a, const FloatN b) { return select(b < a, b, a); }
+
+// Float array aligned for FloatN loads
+template <typename T>
+struct AlignedAllocator {
+	using value_type = T;
+	static constexpr std::align_val_t ALIGNMENT{ 64 };
+
+	AlignedAllocator() = default;
+	template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	T* allocate(const size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), ALIGNMENT)); }
+	void deallocate(T* p, size_t) { ::operator delete(p, ALIGNMENT); }
+
+	template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+using FloatArray = vector<float, AlignedAllocator<float>>;
+
+// Spheres and boxes packed into structure-of-arrays form so one FloatN instruction tests FloatN::WIDTH primitives
+// Arrays are padded to a multiple of the width with NaN primitives that never hit
+struct PackedPrimitives {
+	// Spheres
+	FloatArray sphereX, sphereY, sphereZ, sphereRadius;
+	vector<BVH::Primitive> spheres;
+
+	// Boxes (center, orthonormal basis and half-lengths)
+	FloatArray boxX, boxY, boxZ;
+	FloatArray boxUX, boxUY, boxUZ, boxVX, boxVY, boxVZ, boxWX, boxWY, boxWZ;
+	FloatArray boxHU, boxHV, boxHW;
+	vector<BVH::Primitive> boxes;
+
+	vector<BVH::Primitive> others; // Bounded objects of other types (tested one at a time)
+
+	void build(const vector<BVH::Primitive>& prims) {
+		*this = PackedPrimitives{};
+
+		for (const auto& prim : prims) {
+			if (prim.type == ObjectType::Sphere) {
+				const auto* sphere = static_cast<const Sphere*>(prim.object);
+				sphereX.push_back(sphere->center.x);
+				sphereY.push_back(sphere->center.y);
+				sphereZ.push_back(sphere->center.z);
+				sphereRadius.push_back(sphere->radius);
+				spheres.push_back(prim);
+			}
+			else if (prim.type == ObjectType::Box) {
+				const auto* box = static_cast<const Box*>(prim.object);
+				boxX.push_back(box->center.x);
+				boxY.push_back(box->center.y);
+				boxZ.push_back(box->center.z);
+				boxUX.push_back(box->u.x), boxUY.push_back(box->u.y), boxUZ.push_back(box->u.z);
+				boxVX.push_back(box->v.x), boxVY.push_back(box->v.y), boxVZ.push_back(box->v.z);
+				boxWX.push_back(box->w.x), boxWY.push_back(box->w.y), boxWZ.push_back(box->w.z);
+				boxHU.push_back(box->hu), boxHV.push_back(box->hv), boxHW.push_back(box->hw);
+				boxes.push_back(prim);
+			}
+			else {
+				others.push_back(prim);
+			}
+		}
+
+		const size_t sphereCount = paddedSize(spheres.size());
+		for (FloatArray* array : { &sphereX, &sphereY, &sphereZ, &sphereRadius }) array->resize(sphereCount, NAN);
+
+		const size_t boxCount = paddedSize(boxes.size());
+		for (FloatArray* array : { &boxX, &boxY, &boxZ, &boxUX, &boxUY, &boxUZ, &boxVX, &boxVY, &boxVZ, &boxWX, &boxWY, &boxWZ, &boxHU, &boxHV, &boxHW }) {
+			array->resize(boxCount, NAN);
+		}
+	}
+
+	// Find the closest packed primitive hit by the ray (same arithmetic as Sphere::intersects and Box::intersects)
+	void closestHit(const Ray& ray, Hit& hit) const {
+		const FloatN ox{ ray.origin.x }, oy{ ray.origin.y }, oz{ ray.origin.z };
+		const FloatN dx{ ray.direction.x }, dy{ ray.direction.y }, dz{ ray.direction.z };
+		const FloatN zero{ 0.0f };
+		alignas(64) float dists[FloatN::WIDTH];
+
+		for (size_t i = 0; i < sphereX.size(); i += FloatN::WIDTH) {
+			const FloatN ctoX = ox - FloatN::load(&sphereX[i]);
+			const FloatN ctoY = oy - FloatN::load(&sphereY[i]);
+			const FloatN ctoZ = oz - FloatN::load(&sphereZ[i]);
+			const FloatN radius = FloatN::load(&sphereRadius[i]);
+
+			const FloatN b = FloatN{ 2.0f } * (ctoX * dx + ctoY * dy + ctoZ * dz);
+			const FloatN c = (ctoX * ctoX + ctoY * ctoY + ctoZ * ctoZ) - (radius * radius);
+			const FloatN discriminant = (b * b) - (FloatN{ 4.0f } * c);
+
+			// A negative discriminant gives a NaN distance, which fails the > 0 test
+			const FloatN dist = (-b - sqrt(discriminant)) * FloatN{ 0.5f };
+			reportHits((dist > zero).bits(), dist, dists, &spheres[i], hit);
+		}
+
+		for (size_t i = 0; i < boxX.size(); i += FloatN::WIDTH) {
+			const FloatN toX = ox - FloatN::load(&boxX[i]);
+			const FloatN toY = oy - FloatN::load(&boxY[i]);
+			const FloatN toZ = oz - FloatN::load(&boxZ[i]);
+
+			FloatN minU{ 0.0f }, maxU{ 0.0f }, minV{ 0.0f }, maxV{ 0.0f }, minW{ 0.0f }, maxW{ 0.0f };
+			slab(FloatN::load(&boxHU[i]), FloatN::load(&boxUX[i]), FloatN::load(&boxUY[i]), FloatN::load(&boxUZ[i]), toX, toY, toZ, dx, dy, dz, minU, maxU);
+			slab(FloatN::load(&boxHV[i]), FloatN::load(&boxVX[i]), FloatN::load(&boxVY[i]), FloatN::load(&boxVZ[i]), toX, toY, toZ, dx, dy, dz, minV, maxV);
+			slab(FloatN::load(&boxHW[i]), FloatN::load(&boxWX[i]), FloatN::load(&boxWY[i]), FloatN::load(&boxWZ[i]), toX, toY, toZ, dx, dy, dz, minW, maxW);
+
+			const FloatN entryDist = maxN(maxN(minU, minV), minW);
+			const FloatN exitDist = minN(minN(maxU, maxV), maxW);
+			const FloatN dist = select(entryDist >= zero, entryDist, exitDist);
+			reportHits(((entryDist <= exitDist) & (exitDist > zero)).bits(), dist, dists, &boxes[i], hit);
+		}
+
+		for (const auto& prim : others) {
+			float dist;
+			if (intersect_object(prim.type, *prim.object, ray, dist)) hit.consider(prim.object, prim.id, dist);
+		}
+	}
+
+private:
+	static size_t paddedSize(const size_t count) {
+		return (count + FloatN::WIDTH - 1) / FloatN::WIDTH * FloatN::WIDTH;
+	}
+
+	// Box::calculateMinMax for one axis of the box basis
+	static void slab(const FloatN h, const FloatN ax, const FloatN ay, const FloatN az, const FloatN toX, const FloatN toY, const FloatN toZ,
+		const FloatN dx, const FloatN dy, const FloatN dz, FloatN& minDist, FloatN& maxDist) {
+		const FloatN o = toX * ax + toY * ay + toZ * az;
+		const FloatN d = dx * ax + dy * ay + dz * az;
+		const FloatN lo = (-h - o) / d;
+		const FloatN hi = (h - o) / d;
+
+		const MaskN swapped = hi < lo;
+		minDist = select(swapped, hi, lo);
+		maxDist = select(swapped, lo, hi);
+	}
+
+	// Feed every lane in the hit mask to the closest hit (in lane order so ties resolve like the scalar loop)
+	static void reportHits(unsigned mask, const FloatN dist, float* dists, const BVH::Primitive* prims, Hit& hit) {
+		if (mask == 0) return;
+		dist.store(dists);
+		while (mask != 0) {
+			const int lane = __builtin_ctz(mask);
+			hit.consider(prims[lane].object, prims[lane].id, dists[lane]);
+			mask &= mask - 1;
+		}
+	}
+};
+
+enum class AccelMode {
+	Linear, // Test every object
+	BVH, // Bounded objects go through the BVH, planes are always tested
+	Packed, // Bounded objects are tested in SIMD batches from structure-of-arrays storage, planes are always tested
+};
+
+enum class ShadowMode {
+	Off,
+	AnyHit, // Shadow rays stop at the first blocker, trying each light's last blocker first
+	ClosestHit, // Shadow rays find the closest hit like primary rays (reference for benchmarking AnyHit)
+};
+
+// Last object that blocked each light, per tile (neighboring pixels tend to be shadowed by the same object)
+struct ShadowCache {
+	static constexpr size_t MAX_LIGHTS = 8; // Further lights aren't cached
+	const Object* lastOccluder[MAX_LIGHTS] = {};
+};
+
+constexpr size_t MAX_BOUNCES = 16; // Deepest reflection supported (size of the secondary ray stack)
+
+// Objects, lights, and the acceleration structures built over them
+struct Scene {
+	vector<unique_ptr<Object>> objects;
+	vector<Light> lights;
+	AccelMode accel = AccelMode::BVH;
+	ShadowMode shadows = ShadowMode::Off;
+	size_t maxBounces = 0; // Reflection depth (0 = no reflections), at most MAX_BOUNCES
+
+	vector<ObjectType> types; // Type of every object for dispatch without virtual calls (compiled by build())
+	vector<BVH::Primitive> unbounded; // Infinite objects (planes) that are tested for every ray
+	BVH bvh;
+	PackedPrimitives packed;
+
+	// Moved objects waiting for update()
+	vector<uint32_t> moved;
+	float rebuildThreshold = 1.5f; // SAH cost growth that makes update() rebuild instead of refit (0 = always rebuild)
+	size_t builds = 0; // Builds so far, the first one and those done by update() included
+
+	// Change tracking, so renderers know which objects changed since they last drew the scene
+	static constexpr size_t MAX_CHANGE_LOG = 4096; // Older changes are forgotten (renderers redraw everything)
+	uint64_t changeClock = 0; // Advances with every change
+	uint64_t forgetClock = 0; // Changes up to this clock are no longer listed individually
+	vector<std::pair<uint64_t, uint32_t>> changeLog; // (clock, object index), oldest first
+	uint64_t geometryClock = 0; // Clock of the last change to the objects (light changes don't advance it)
+
+	// Record that a bounded object moved or changed its size, for the next update() (also marks it changed)
+	void markMoved(const size_t index) {
+		markChanged(index);
+		moved.push_back(static_cast<uint32_t>(index));
+	}
+
+	// Record that an object changed its appearance (use markMoved() when its bounds changed)
+	void markChanged(const size_t index) {
+		if (changeLog.size() >= MAX_CHANGE_LOG) {
+			forgetClock = changeClock;
+			changeLog.clear();
+		}
+		changeLog.emplace_back(++changeClock, static_cast<uint32_t>(index));
+		geometryClock = changeClock;
+	}
+
+	// Record a change that can affect any pixel (objects added or removed)
+	void markAllChanged() {
+		forgetClock = ++changeClock;
+		changeLog.clear();
+		geometryClock = changeClock;
+	}
+
+	// Record that lights changed: every pixel's shading changes, but what the pixels see doesn't
+	void markLightsChanged() {
+		forgetClock = ++changeClock;
+		changeLog.clear();
+	}
+
+	// Collect the objects changed after the clock, false when those changes are no longer known individually
+	bool changesSince(const uint64_t clock, vector<uint32_t>& changed) const {
+		changed.clear();
+		if (clock < forgetClock) return false;
+
+		auto it = std::upper_bound(changeLog.begin(), changeLog.end(), clock,
+			[](const uint64_t c, const std::pair<uint64_t, uint32_t>& change) { return c < change.first; });
+		for (; it != changeLog.end(); ++it) changed.push_back(it->second);
+		return true;
+	}
+
+	// Rebuild the acceleration structures (call after adding or removing objects, moved objects only need markMoved())
+	void build() {
+		++builds;
+		moved.clear();
+		unbounded.clear();
+		vector<BVH::Primitive> bounded;
+
+		types.resize(objects.size());
+		AABB bounds;
+		for (size_t i = 0; i < objects.size(); ++i) {
+			types[i] = object_type(*objects[i]);
+			const BVH::Primitive prim{ objects[i].get(), static_cast<uint32_t>(i), types[i] };
+			if (objects[i]->getBounds(bounds)) bounded.push_back(prim);
+			else unbounded.push_back(prim);
+		}
+
+		if (accel == AccelMode::Packed) packed.build(bounded);
+		bvh.build(std::move(bounded));
+	}
+
+	// Bring the acceleration structures up to date with the objects marked moved since the last update
+	// The BVH is refit bottom-up from the moved objects' leaves, O(moved x depth), and rebuilt once the refits made it
+	// rebuildThreshold times as costly to traverse as when it was built (by SAH cost). Only the scene BVH over the
+	// objects changes, instanced geometry and mesh BVHs stay as they are.
+	void update() {
+		if (moved.empty()) return;
+
+		if (rebuildThreshold <= 0.0f) {
+			build();
+		}
+		else {
+			// Past about one move per node, a single sweep over the whole tree is cheaper than walking up from each leaf
+			if (moved.size() * (bvh.height + 1) > bvh.nodes.size()) bvh.refit();
+			else for (const uint32_t index : moved) bvh.refitPrimitive(index);
+
+			if (bvh.degradation() > rebuildThreshold) build();
+			else if (accel == AccelMode::Packed) packed.build(bvh.primitives); // Copies of the geometry, O(objects) like its traversal
+		}
+		moved.clear();
+	}
+
+	// Find the closest object hit by the ray
+	// Unbounded objects among the first 64 are skipped when their bit in unboundedMask is clear (horizon culling)
+	void closestHit(const Ray& ray, Hit& hit, const uint64_t unboundedMask = ~uint64_t{ 0 }) const {
+		if (accel == AccelMode::Linear) {
+			for (size_t i = 0; i < objects.size(); ++i) {
+				float dist;
+				if (intersect_object(types[i], *objects[i], ray, dist)) hit.consider(objects[i].get(), static_cast<uint32_t>(i), dist);
+			}
+			return;
+		}
+
+		for (size_t i = 0; i < unbounded.size(); ++i) {
+			if (i < 64 && !((unboundedMask >> i) & 1)) continue;
+
+			float dist;
+			if (intersect_object(unbounded[i].type, *unbounded[i].object, ray, dist)) hit.consider(unbounded[i].object, unbounded[i].id, dist);
+		}
+
+		if (accel == AccelMode::Packed) packed.closestHit(ray, hit);
+		else bvh.closestHit(ray, hit);
+	}
+
+	// Whether any object blocks the ray closer than maxDist
+	// lastOccluder is tested first and set to the blocking object (the packed mode uses the BVH, which is always built)
+	bool occluded(const Ray& ray, const float maxDist, const Object*& lastOccluder) const {
+		if (lastOccluder && lastOccluder->occludes(ray, maxDist)) return true;
+
+		const Object* occluder = nullptr;
+		if (accel == AccelMode::Linear) {
+			for (size_t i = 0; i < objects.size() && !occluder; ++i) {
+				if (occlude_object(types[i], *objects[i], ray, maxDist)) occluder = objects[i].get();
+			}
+		}
+		else {
+			for (size_t i = 0; i < unbounded.size() && !occluder; ++i) {
+				if (occlude_object(unbounded[i].type, *unbounded[i].object, ray, maxDist)) occluder = unbounded[i].object;
+			}
+			if (!occluder) occluder = bvh.anyHit(ray, maxDist);
+		}
+
+		if (occluder) lastOccluder = occluder;
+		return occluder != nullptr;
+	}
+
+	// Find the closest objects hit by a packet of rays (only the BVH traces packets, other modes trace each ray)
+	void closestHitPacket(RayPacket& packet) const {
+		if (accel != AccelMode::BVH) {
+			for (size_t i = 0; i < packet.count; ++i) closestHit(packet.ray(i), packet.hits[i]);
+			return;
+		}
+
+		for (const auto& prim : unbounded) {
+			// Rays hit a plane when their direction points toward it. The frustum is the convex hull of the corner rays,
+			// so the whole packet misses if no corner ray points toward the plane.
+			if ((prim.type == ObjectType::Plane || prim.type == ObjectType::Checkerboard) && packet.hasFrustum) {
+				const auto* plane = static_cast<const Plane*>(prim.object);
+				const float side = (plane->center - packet.origin).dot(plane->normal);
+				bool anyToward = false;
+				for (const Vec3& corner : packet.corners) anyToward |= side * plane->normal.dot(corner) > 0.0f;
+				if (!anyToward) continue;
+			}
+
+			for (size_t i = 0; i < packet.count; ++i) {
+				float dist;
+				if (intersect_object(prim.type, *prim.object, packet.ray(i), dist)) packet.hits[i].consider(prim.object, prim.id, dist);
+			}
+		}
+
+		bvh.closestHitPacket(packet);
+	}
+};
+
+
+// Offset of shadow ray origins along the normal, so they don't hit the surface they start on
+constexpr float SHADOW_BIAS = 1e-2f;
+
+// Shade a surface hit with the scene lights (Lambertian diffuse plus Blinn-Phong specular)
+// Lights blocked by another object are skipped when the scene has shadows
+Pixel shade_hit(const Scene& scene, const Ray& ray, const Hit& hit, ShadowCache* shadowCache = nullptr) {
+	// Calculate the hit point and normal at the intersection
+	const Vec3 hitPoint = ray.origin + ray.direction * hit.dist;
+	const ObjectType type = scene.types[hit.id];
+	const Vec3 normal = hit_normal(type, *hit.object, ray, hit.dist);
+
+	const Pixel surfaceColor = color_at(type, *hit.object, hitPoint);
+
+	// Accumulate the light sources onto the object
+	float rTotal = 0, gTotal = 0, bTotal = 0;
+	const float object_r_factor = surfaceColor.r / RGB_MAX_FLOAT;
+	const float object_g_factor = surfaceColor.g / RGB_MAX_FLOAT;
+	const float object_b_factor = surfaceColor.b / RGB_MAX_FLOAT;
+	for (size_t lightIndex = 0; lightIndex < scene.lights.size(); ++lightIndex) {
+		const Light& light = scene.lights[lightIndex];
+
+		// Diffuse shading ( Lambertian reflectance)
+		const float diffuse = normal.dot(light.direction);
+		if (diffuse <= 0.0f) continue; // Only calculate if light is facing the surface
+
+		// Directional lights are infinitely far away, so anything along the shadow ray blocks them
+		if (scene.shadows != ShadowMode::Off) {
+			const Ray shadowRay{ hitPoint + normal * SHADOW_BIAS, light.direction };
+			if (scene.shadows == ShadowMode::ClosestHit) {
+				Hit shadowHit;
+				scene.closestHit(shadowRay, shadowHit);
+				if (shadowHit.object) continue;
+			}
+			else {
+				const Object* uncached = nullptr;
+				const bool cached = shadowCache && lightIndex < ShadowCache::MAX_LIGHTS;
+				if (scene.occluded(shadowRay, INFINITY, cached ? shadowCache->lastOccluder[lightIndex] : uncached)) continue;
+			}
+		}
+
+		// Diffuse color
+		rTotal += object_r_factor * diffuse * light.color.r;
+		gTotal += object_g_factor * diffuse * light.color.g;
+		bTotal += object_b_factor * diffuse * light.color.b;
+
+		// Specular shading (Blinn-Phong)
+		const Vec3 halfway = (light.direction - ray.direction).norm();
+
+		const float specularAngle = max(0.0f, normal.dot(halfway));
+		const float specular = pow(specularAngle, SPECULAR_SHININESS);
+
+		rTotal += specular * light.color.r;
+		gTotal += specular * light.color.g;
+		bTotal += specular * light.color.b;
+	}
+
+	return Pixel{
+		static_cast<u_char>(min(rTotal, RGB_MAX_FLOAT)),
+		static_cast<u_char>(min(gTotal, RGB_MAX_FLOAT)),
+		static_cast<u_char>(min(bTotal, RGB_MAX_FLOAT))
+	};
+}
+
+// Small hash for per-pixel random numbers that don't depend on the thread or tile order
+uint32_t hash_u32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Uniform float in [-1, 1) from a hash
+float hash_to_signed(const uint32_t h) {
+	return static_cast<float>(h >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+// Shade a primary hit and follow its reflections up to scene.maxBounces
+// Secondary rays go through a fixed-size stack instead of recursion or the heap. Each hit pushes at most one reflected
+// ray carrying the weight it contributes, and rays whose weight can't change the 8-bit result anymore are dropped.
+// rays counts the secondary rays traced, seed varies the glossy spread per pixel.
+Pixel shade_path(const Scene& scene, const Ray& ray, const Hit& hit, ShadowCache* shadowCache, const uint32_t seed, size_t& rays) {
+	if (scene.maxBounces == 0 || hit.object->reflectivity <= 0.0f) return shade_hit(scene, ray, hit, shadowCache);
+
+	struct PathRay {
+		Vec3 origin, direction;
+		float weight; // Share of the pixel color this ray decides
+		size_t depth; // Reflections so far
+	};
+	PathRay stack[MAX_BOUNCES + 1];
+	size_t stackSize = 0;
+	stack[stackSize++] = PathRay{ ray.origin, ray.direction, 1.0f, 0 };
+
+	constexpr float MIN_WEIGHT = 1.0f / RGB_MAX_FLOAT; // Less can't change a color channel
+	float rTotal = 0.0f, gTotal = 0.0f, bTotal = 0.0f;
+	while (stackSize > 0) {
+		const PathRay current = stack[--stackSize];
+		const Ray currentRay{ current.origin, current.direction };
+
+		Hit currentHit = hit;
+		if (current.depth > 0) {
+			currentHit = Hit{};
+			scene.closestHit(currentRay, currentHit);
+			++rays;
+			if (!currentHit.object) continue; // Black background
+		}
+
+		const Object& object = *currentHit.object;
+		const float reflectivity = clamp(object.reflectivity, 0.0f, 1.0f);
+		const Pixel local = shade_hit(scene, currentRay, currentHit, shadowCache);
+		const float localWeight = current.weight * (1.0f - reflectivity);
+		rTotal += localWeight * local.r;
+		gTotal += localWeight * local.g;
+		bTotal += localWeight * local.b;
+
+		const float reflectedWeight = current.weight * reflectivity;
+		if (current.depth >= scene.maxBounces || reflectedWeight < MIN_WEIGHT) continue;
+
+		// Mirror the ray about the normal facing it, and start just above the surface
+		const Vec3 hitPoint = currentRay.origin + currentRay.direction * currentHit.dist;
+		Vec3 normal = hit_normal(scene.types[currentHit.id], object, currentRay, currentHit.dist);
+		if (normal.dot(currentRay.direction) > 0.0f) normal = -normal;
+		Vec3 reflected = currentRay.direction - normal * (2.0f * currentRay.direction.dot(normal));
+
+		// Glossy surfaces spread the reflection randomly (kept above the surface)
+		if (object.roughness > 0.0f) {
+			const uint32_t h = hash_u32(seed * 31u + static_cast<uint32_t>(current.depth));
+			const Vec3 spread{ hash_to_signed(hash_u32(h)), hash_to_signed(hash_u32(h + 1)), hash_to_signed(hash_u32(h + 2)) };
+			const Vec3 glossy = (reflected + spread * object.roughness).norm();
+			if (glossy.dot(normal) > 0.0f) reflected = glossy;
+		}
+
+		stack[stackSize++] = PathRay{ hitPoint + normal * SHADOW_BIAS, reflected.norm(), reflectedWeight, current.depth + 1 };
+	}
+
+	return Pixel{
+		static_cast<u_char>(min(rTotal, RGB_MAX_FLOAT)),
+		static_cast<u_char>(min(gTotal, RGB_MAX_FLOAT)),
+		static_cast<u_char>(min(bTotal, RGB_MAX_FLOAT))
+	};
+}
+
+// Decide which pixels to trace again this frame. A pixel keeps last frame's color when the camera didn't move, the object
+// it hit didn't change, and no changed object now covers it. Changed objects are found through the scene's change log
+// and the pixels they may cover through the screen footprint of their bounds. With Reproject, small camera moves carry
+// last frame's hits over to the pixels they land on in the new view, and only the holes are traced.
+void Display3D::planReuse(const Camera& camera, const Scene& scene, const size_t renderWidth, const size_t renderHeight, const float aspect, const float planeWidth, const float planeHeight) {
+	constexpr float MAX_REPROJECT_DEGREES = 2.0f; // Larger turns trace everything again
+	constexpr float MAX_REPROJECT_DISTANCE = 1.0f; // Larger moves trace everything again
+	constexpr uint8_t MAX_REPROJECT_AGE = 8; // Reprojected pixels are traced again after at most this many frames
+	constexpr float NEAR = 1e-3f; // Points closer to the camera plane than this don't project
+
+	PixelHistory& h = history;
+	const size_t numPixels = renderWidth * renderHeight;
+	h.retrace.assign(numPixels, 1);
+	h.reusedPixels = 0;
+
+	const bool sameView = h.valid && h.width == renderWidth && h.height == renderHeight && h.aspect == aspect;
+	const Vec3 lastPosition{ h.position[0], h.position[1], h.position[2] };
+	const Vec3 moved = camera.position - lastPosition;
+	const float turnedYaw = std::fabs(std::remainder(camera.yawDegrees - h.yawDegrees, 360.0f));
+	const float turnedPitch = std::fabs(camera.pitchDegrees - h.pitchDegrees);
+	const bool still = moved.x == 0.0f && moved.y == 0.0f && moved.z == 0.0f && camera.yawDegrees == h.yawDegrees && camera.pitchDegrees == h.pitchDegrees;
+	const bool reproject = reuse == TemporalReuse::Reproject && scene.maxBounces == 0 && sqrt(moved.dot(moved)) <= MAX_REPROJECT_DISTANCE
+		&& turnedYaw <= MAX_REPROJECT_DEGREES && turnedPitch <= MAX_REPROJECT_DEGREES;
+
+	// With shadows or reflections a changed object can affect any pixel, so only a still scene is reused
+	// (reflections also depend on the view direction, so they are never reprojected)
+	const bool global = scene.shadows != ShadowMode::Off || scene.maxBounces > 0;
+	if (!sameView || (!still && !reproject) || !scene.changesSince(h.sceneClock, h.changed) || (global && !h.changed.empty())) {
+		h.ids.assign(numPixels, PixelHistory::MISS);
+		h.dists.assign(numPixels, INFINITY);
+		h.colors.assign(numPixels, Pixel{ 0, 0, 0 });
+		h.ages.assign(numPixels, 0);
+		return;
+	}
+
+	h.dirty.resize(scene.objects.size(), 0);
+	for (const uint32_t id : h.changed) {
+		if (id < h.dirty.size()) h.dirty[id] = 1;
+	}
+	const auto isDirty = [&h](const uint32_t id) {
+		return id != PixelHistory::MISS && (id >= h.dirty.size() || h.dirty[id]);
+	};
+
+	Vec3 forward, right, up;
+	camera.get_basis(forward, right, up);
+
+	if (still) {
+		// Reprojected pixels are approximate, so they are traced again as soon as the camera stops
+		for (size_t i = 0; i < numPixels; ++i) h.retrace[i] = h.ages[i] > 0 || isDirty(h.ids[i]);
+	}
+	else {
+		Vec3 lastForward, lastRight, lastUp;
+		Camera{ lastPosition, h.yawDegrees, h.pitchDegrees }.get_basis(lastForward, lastRight, lastUp);
+
+		h.nextIds.assign(numPixels, PixelHistory::MISS);
+		h.nextDists.assign(numPixels, INFINITY);
+		h.nextColors.assign(numPixels, Pixel{ 0, 0, 0 });
+		h.nextAges.assign(numPixels, 0);
+
+		// Move each hit point to the pixel it lands on in the new view, the closest one wins
+		for (size_t i = 0; i < numPixels; ++i) {
+			if (h.ids[i] == PixelHistory::MISS || isDirty(h.ids[i])) continue;
+
+			const float* d = &rayCache.cameraSpace[i * 3];
+			const Vec3 direction = (lastRight * d[0]) + (lastUp * d[1]) + (lastForward * d[2]);
+			const Vec3 toPoint = lastPosition + direction * h.dists[i] - camera.position;
+
+			const float z = toPoint.dot(forward);
+			if (z <= NEAR) continue;
+			const float col = (0.5f - toPoint.dot(right) / z / planeWidth) * renderWidth;
+			const float row = (toPoint.dot(up) / z / planeHeight + 0.5f) * renderHeight;
+			if (!(col >= 0.0f && row >= 0.0f && col < renderWidth && row < renderHeight)) continue;
+
+			const size_t j = static_cast<size_t>(row) * renderWidth + static_cast<size_t>(col);
+			const float dist = sqrt(toPoint.dot(toPoint));
+			if (dist < h.nextDists[j]) {
+				h.nextIds[j] = h.ids[i];
+				h.nextDists[j] = dist;
+				h.nextColors[j] = h.colors[i];
+				h.nextAges[j] = h.ages[i] < UINT8_MAX ? h.ages[i] + 1 : UINT8_MAX;
+			}
+		}
+
+		h.ids.swap(h.nextIds);
+		h.dists.swap(h.nextDists);
+		h.colors.swap(h.nextColors);
+		h.ages.swap(h.nextAges);
+
+		// Trace the holes, and expire old pixels at staggered ages so they aren't all traced in the same frame
+		for (size_t i = 0; i < numPixels; ++i) {
+			const uint32_t stagger = static_cast<uint32_t>(i * 2654435761u) >> 29; // 0-7
+			h.retrace[i] = h.ids[i] == PixelHistory::MISS || h.ages[i] > MAX_REPROJECT_AGE / 2 + stagger % (MAX_REPROJECT_AGE / 2);
+		}
+	}
+
+	// Trace again wherever a changed object may be now
+	for (const uint32_t id : h.changed) {
+		AABB bounds;
+		if (id >= scene.objects.size() || !scene.objects[id]->getBounds(bounds)) { // Unbounded objects can cover any pixel
+			fill(h.retrace.begin(), h.retrace.end(), 1);
+			break;
+		}
+
+		// Screen rectangle around the projected corners of the bounds
+		float minCol = INFINITY, maxCol = -INFINITY, minRow = INFINITY, maxRow = -INFINITY;
+		bool behind = false;
+		for (int corner = 0; corner < 8; ++corner) {
+			const Vec3 p{ (corner & 1) ? bounds.upper.x : bounds.lower.x, (corner & 2) ? bounds.upper.y : bounds.lower.y, (corner & 4) ? bounds.upper.z : bounds.lower.z };
+			const Vec3 toCorner = p - camera.position;
+			const float z = toCorner.dot(forward);
+			if (z <= NEAR) { // The projection of bounds reaching behind the camera isn't bounded
+				behind = true;
+				break;
+			}
+
+			const float col = (0.5f - toCorner.dot(right) / z / planeWidth) * renderWidth;
+			const float row = (toCorner.dot(up) / z / planeHeight + 0.5f) * renderHeight;
+			minCol = min(minCol, col);
+			maxCol = max(maxCol, col);
+			minRow = min(minRow, row);
+			maxRow = max(maxRow, row);
+		}
+
+		if (behind) {
+			fill(h.retrace.begin(), h.retrace.end(), 1);
+			break;
+		}
+
+		// One pixel of margin against rounding
+		const float colStart = max(std::floor(minCol) - 1.0f, 0.0f), colEnd = min(std::ceil(maxCol) + 1.0f, static_cast<float>(renderWidth) - 1.0f);
+		const float rowStart = max(std::floor(minRow) - 1.0f, 0.0f), rowEnd = min(std::ceil(maxRow) + 1.0f, static_cast<float>(renderHeight) - 1.0f);
+		if (colStart > colEnd || rowStart > rowEnd) continue; // Off screen
+
+		for (size_t row = static_cast<size_t>(rowStart); row <= static_cast<size_t>(rowEnd); ++row) {
+			fill(h.retrace.begin() + row * renderWidth + static_cast<size_t>(colStart), h.retrace.begin() + row * renderWidth + static_cast<size_t>(colEnd) + 1, 1);
+		}
+	}
+
+	for (const uint32_t id : h.changed) {
+		if (id < h.dirty.size()) h.dirty[id] = 0;
+	}
+
+	// Packets are traced whole, so a packet is traced again if any of its pixels is
+	if (packets) {
+		for (size_t blockRow = 0; blockRow < renderHeight; blockRow += PACKET_SIZE) {
+			for (size_t blockCol = 0; blockCol < renderWidth; blockCol += PACKET_SIZE) {
+				const size_t rowEnd = min(blockRow + PACKET_SIZE, renderHeight);
+				const size_t colEnd = min(blockCol + PACKET_SIZE, renderWidth);
+
+				uint8_t any = 0;
+				for (size_t row = blockRow; row < rowEnd; ++row) {
+					for (size_t col = blockCol; col < colEnd; ++col) any |= h.retrace[row * renderWidth + col];
+				}
+				if (!any) continue;
+				for (size_t row = blockRow; row < rowEnd; ++row) fill(h.retrace.begin() + row * renderWidth + blockCol, h.retrace.begin() + row * renderWidth + colEnd, 1);
+			}
+		}
+	}
+
+	h.reusedPixels = static_cast<size_t>(std::count(h.retrace.begin(), h.retrace.end(), 0));
+}
+
+// Primary rays through any position in a pixel, mapped like the ray direction cache (0.5, 0.5 is the pixel center)
+struct PixelRays {
+	Vec3 forward, right, up;
+	float invWidth, invHeight;
+	float planeWidth, planeHeight;
+
+	PixelRays(const Camera& camera, const size_t renderWidth, const size_t renderHeight, const float planeW, const float planeH)
+		: invWidth{ 1.0f / static_cast<float>(renderWidth) }, invHeight{ 1.0f / static_cast<float>(renderHeight) }, planeWidth{ planeW }, planeHeight{ planeH } {
+		camera.get_basis(forward, right, up);
+	}
+
+	Vec3 direction(const size_t row, const size_t col, const float dx, const float dy) const {
+		const float x = -((col + dx) * invWidth - 0.5f) * planeWidth; // Negate for correct orientation (flip)
+		const float y = ((row + dy) * invHeight - 0.5f) * planeHeight;
+		const Vec3 d = Vec3{ x, y, 1.0f }.norm();
+		return (right * d.x) + (up * d.y) + (forward * d.z);
+	}
+};
+
+// Progressive anti-aliasing. While the camera, render size, and scene stay as they were when the accumulation started, every
+// frame traces one more sample per pixel at a jittered position and shows the average of all samples so far (the first
+// sample is the regular frame through the pixel centers). A frame never costs more than one ray per pixel, and once
+// maxSamples are in it traces nothing. Returns false when the view changed and the frame has to be rendered normally.
+bool Display3D::refine(const Camera& camera, const Scene& scene, const size_t renderWidth, const size_t renderHeight, const float aspect, const float planeWidth, const float planeHeight, vector<Pixel>& target) {
+	SampleAccumulator& acc = accumulator;
+	const bool still = acc.valid && acc.width == renderWidth && acc.height == renderHeight && acc.aspect == aspect
+		&& acc.position[0] == camera.position.x && acc.position[1] == camera.position.y && acc.position[2] == camera.position.z
+		&& acc.yawDegrees == camera.yawDegrees && acc.pitchDegrees == camera.pitchDegrees && acc.sceneClock == scene.changeClock;
+	if (!still) return false;
+
+	primaryRays = 0;
+	secondaryRays = 0;
+	if (acc.samples < maxSamples) {
+		// Position in the pixel from the R2 low-discrepancy sequence (sample 0 would be the center)
+		const float jitterX = std::fmod(0.5f + acc.samples * 0.754877669f, 1.0f);
+		const float jitterY = std::fmod(0.5f + acc.samples * 0.569840296f, 1.0f);
+		const uint32_t sampleSeed = hash_u32(static_cast<uint32_t>(acc.samples)); // Varies glossy reflections per sample
+
+		const PixelRays rays{ camera, renderWidth, renderHeight, planeWidth, planeHeight };
+
+		std::atomic<size_t> reflectionRays{ 0 };
+		const std::function<void(size_t)> renderRow = [&](const size_t row) {
+			ShadowCache shadowCache;
+			size_t rowRays = 0;
+			for (size_t col = 0; col < renderWidth; ++col) {
+				const Ray ray{ camera.position, rays.direction(row, col, jitterX, jitterY) };
+
+				Hit hit;
+				scene.closestHit(ray, hit);
+				if (!hit.object) continue; // Black background adds nothing
+
+				const size_t i = row * renderWidth + col;
+				const Pixel color = shade_path(scene, ray, hit, &shadowCache, static_cast<uint32_t>(i) ^ sampleSeed, rowRays);
+				float* sum = &acc.sums[i * 3];
+				sum[0] += color.r;
+				sum[1] += color.g;
+				sum[2] += color.b;
+			}
+			reflectionRays += rowRays;
+		};
+
+		if (pool) pool->run(renderHeight, renderRow);
+		else for (size_t row = 0; row < renderHeight; ++row) renderRow(row);
+
+		++acc.samples;
+		primaryRays = renderWidth * renderHeight;
+		secondaryRays = reflectionRays;
+	}
+
+	const float scale = 1.0f / static_cast<float>(acc.samples);
+	for (size_t i = 0; i < renderWidth * renderHeight; ++i) {
+		const float* sum = &acc.sums[i * 3];
+		target[i] = Pixel{
+			static_cast<u_char>(sum[0] * scale + 0.5f),
+			static_cast<u_char>(sum[1] * scale + 0.5f),
+			static_cast<u_char>(sum[2] * scale + 0.5f)
+		};
+	}
+	return true;
+}
+
+// Adaptive anti-aliasing of the pixels traced this frame. A pixel is on an edge when a neighbor hit another object, a
+// surface facing another way (box edges), or differs in color (checkerboard cells, shading). Edge pixels get SAMPLES
+// extra rays on a rotated grid, blended with their first sample. When there are more edge pixels than the budget
+// covers, the most contrasted ones are sampled.
+void Display3D::sampleEdges(const Camera& camera, const Scene& scene, const size_t renderWidth, const size_t renderHeight, const float planeWidth, const float planeHeight, vector<Pixel>& target) {
+	constexpr float NORMAL_EDGE = 0.9f; // Normals of neighbors closer than this (cosine of about 25 degrees) are an edge
+	constexpr int COLOR_EDGE = 48; // Sum of channel differences
+	constexpr uint32_t OBJECT_CONTRAST = 1024, NORMAL_CONTRAST = 512; // Above any color contrast (at most 765)
+	constexpr float GRID[EdgeSampler::SAMPLES][2] = { { 0.375f, 0.125f }, { 0.875f, 0.375f }, { 0.625f, 0.875f }, { 0.125f, 0.625f } };
+
+	EdgeSampler& e = edgeSampler;
+	const bool reusing = reuse != TemporalReuse::Off;
+	const auto traced = [&](const size_t i) {
+		return !reusing || history.retrace[i];
+	};
+
+	// Contrast between two neighbors (0 = no edge)
+	const auto contrast = [&](const size_t a, const size_t b) -> uint32_t {
+		if (e.ids[a] != e.ids[b]) return OBJECT_CONTRAST;
+		if (e.ids[a] == PixelHistory::MISS) return 0;
+		const float* na = &e.normals[a * 3];
+		const float* nb = &e.normals[b * 3];
+		const uint32_t bend = na[0] * nb[0] + na[1] * nb[1] + na[2] * nb[2] < NORMAL_EDGE ? NORMAL_CONTRAST : 0;
+		const int difference = abs(target[a].r - target[b].r) + abs(target[a].g - target[b].g) + abs(target[a].b - target[b].b);
+		return bend + (difference > COLOR_EDGE ? static_cast<uint32_t>(difference) : 0);
+	};
+
+	// Both pixels of a contrasted neighbor pair are edge pixels, with their largest contrast to any neighbor
+	const size_t numPixels = renderWidth * renderHeight;
+	e.contrasts.assign(numPixels, 0);
+	for (size_t row = 0; row < renderHeight; ++row) {
+		for (size_t col = 0; col < renderWidth; ++col) {
+			const size_t i = row * renderWidth + col;
+			if (col + 1 < renderWidth) {
+				const uint32_t c = contrast(i, i + 1);
+				e.contrasts[i] = max(e.contrasts[i], c);
+				e.contrasts[i + 1] = max(e.contrasts[i + 1], c);
+			}
+			if (row + 1 < renderHeight) {
+				const uint32_t c = contrast(i, i + renderWidth);
+				e.contrasts[i] = max(e.contrasts[i], c);
+				e.contrasts[i + renderWidth] = max(e.contrasts[i + renderWidth], c);
+			}
+		}
+	}
+
+	// Reused pixels keep the colors they were sampled to when they were traced
+	e.edges.clear();
+	for (size_t i = 0; i < numPixels; ++i) {
+		if (e.contrasts[i] > 0 && traced(i)) e.edges.emplace_back(e.contrasts[i], static_cast<uint32_t>(i));
+	}
+	e.edgePixels = e.edges.size();
+
+	// Keep the most contrasted edge pixels the budget covers
+	const size_t affordable = e.budget / EdgeSampler::SAMPLES;
+	if (e.edges.size() > affordable) {
+		std::nth_element(e.edges.begin(), e.edges.begin() + affordable, e.edges.end(), std::greater<>{});
+		e.edges.resize(affordable);
+	}
+	e.sampledPixels = e.edges.size();
+	if (e.edges.empty()) return;
+
+	const PixelRays rays{ camera, renderWidth, renderHeight, planeWidth, planeHeight };
+	constexpr size_t CHUNK = 256; // Edge pixels per task
+	std::atomic<size_t> reflectionRays{ 0 };
+	const std::function<void(size_t)> sampleChunk = [&](const size_t chunk) {
+		ShadowCache shadowCache;
+		size_t chunkRays = 0;
+		const size_t end = min((chunk + 1) * CHUNK, e.edges.size());
+		for (size_t k = chunk * CHUNK; k < end; ++k) {
+			const size_t i = e.edges[k].second;
+			const size_t row = i / renderWidth, col = i % renderWidth;
+
+			// Blend the first sample (through the center) with the grid samples
+			float r = target[i].r, g = target[i].g, b = target[i].b;
+			for (size_t sample = 0; sample < EdgeSampler::SAMPLES; ++sample) {
+				const Ray ray{ camera.position, rays.direction(row, col, GRID[sample][0], GRID[sample][1]) };
+				Hit hit;
+				scene.closestHit(ray, hit);
+				if (!hit.object) continue;
+
+				const Pixel color = shade_path(scene, ray, hit, &shadowCache, static_cast<uint32_t>(i) ^ hash_u32(static_cast<uint32_t>(sample + 1)), chunkRays);
+				r += color.r;
+				g += color.g;
+				b += color.b;
+			}
+
+			constexpr float scale = 1.0f / (EdgeSampler::SAMPLES + 1);
+			target[i] = Pixel{ static_cast<u_char>(r * scale + 0.5f), static_cast<u_char>(g * scale + 0.5f), static_cast<u_char>(b * scale + 0.5f) };
+			if (reusing) history.colors[i] = target[i];
+		}
+		reflectionRays += chunkRays;
+	};
+
+	const size_t numChunks = (e.edges.size() + CHUNK - 1) / CHUNK;
+	if (pool) pool->run(numChunks, sampleChunk);
+	else for (size_t chunk = 0; chunk < numChunks; ++chunk) sampleChunk(chunk);
+
+	primaryRays += e.edges.size() * EdgeSampler::SAMPLES;
+	secondaryRays += reflectionRays;
+}
+
+// Render the 3D scene to the image
+void Display3D::render_scene_to_image(const Camera& camera, const Scene& scene) {
+	// Calculate aspect ratio for proper scaling
+	// Scale width by the pixel shape (0.5 for the 2:1 tall rectangular pixels of the cell backend)
+	const float aspect = (width * pixelAspect) / static_cast<float>(height);
+
+	// Distance from camera to image plane
+	constexpr float camera_to_plane = 1.0f;
+
+	// Calculate the size of the image plane based on FOV and aspect ratio
+	const float plane_height = 2.0f * camera_to_plane * tan(degToRad(FOV * 0.5f));
+	const float plane_width = plane_height * aspect;
+
+	// Get camera basis vectors
+	Vec3 forward, right, up;
+	camera.get_basis(forward, right, up);
+
+	// Rays are traced at the render scale and upscaled into the image afterwards
+	const size_t renderWidth = getRenderCols();
+	const size_t renderHeight = getRenderRows();
+	const bool scaled = renderWidth != width || renderHeight != height;
+	vector<Pixel>& target = scaled ? scaledPixels : flattenedPixels;
+	if (scaled) scaledPixels.assign(renderWidth * renderHeight, Pixel{ 0, 0, 0 });
+
+	const auto targetAt = [&](const size_t row, const size_t col) -> Pixel& {
+		return target[row * renderWidth + col];
+	};
+
+	// While the view holds still, add anti-aliasing samples to the last frame instead of rendering it again
+	if (maxSamples > 1 && refine(camera, scene, renderWidth, renderHeight, aspect, plane_width, plane_height, target)) {
+		edgeSampler.edgePixels = edgeSampler.sampledPixels = 0;
+		if (scaled) upscale(renderWidth, renderHeight);
+		return;
+	}
+
+	// Rebuild the camera space directions when the render size or FOV changed
+	RayDirectionCache& cache = rayCache;
+	if (cache.width != renderWidth || cache.height != renderHeight || cache.aspect != aspect || cache.fov != FOV) {
+		const float invWidth = 1.0f / static_cast<float>(renderWidth);
+		const float invHeight = 1.0f / static_cast<float>(renderHeight);
+
+		cache.cameraSpace.resize(renderWidth * renderHeight * 3);
+		cache.world.resize(renderWidth * renderHeight * 3);
+		for (size_t row = 0; row < renderHeight; ++row) {
+			for (size_t col = 0; col < renderWidth; ++col) {
+				// Map pixel to coordinates on the image plane
+				const float x = -((col + 0.5f) * invWidth - 0.5f) * plane_width; // Negate for correct orientation (flip)
+				const float y = ((row + 0.5f) * invHeight - 0.5f) * plane_height;
+				const Vec3 d = Vec3{ x, y, camera_to_plane }.norm();
+				float* out = &cache.cameraSpace[(row * renderWidth + col) * 3];
+				out[0] = d.x;
+				out[1] = d.y;
+				out[2] = d.z;
+			}
+		}
+
+		cache.width = renderWidth;
+		cache.height = renderHeight;
+		cache.aspect = aspect;
+		cache.fov = FOV;
+		cache.yawDegrees = NAN; // Force a rotation
+	}
+
+	// Rotate into world space (done per tile below) only when the camera turned
+	const bool rotate = cache.yawDegrees != camera.yawDegrees || cache.pitchDegrees != camera.pitchDegrees;
+	cache.yawDegrees = camera.yawDegrees;
+	cache.pitchDegrees = camera.pitchDegrees;
+
+	// Direction of the ray from the camera through the center of a pixel
+	const auto primaryDirection = [&](const size_t row, const size_t col) {
+		const float* d = &cache.world[(row * renderWidth + col) * 3];
+		return Vec3{ d[0], d[1], d[2] };
+	};
+
+	// Horizon culling for infinite planes. A primary ray can only hit a plane when it points toward it, so normal . direction
+	// must have the sign of the camera's side of the plane. In camera space that's the sign of a * x + b * y + c, which is
+	// affine in the pixel coordinates, so the end pixels of a row span decide it for the whole span. Spans pointing away
+	// from a plane (the part of the screen beyond its horizon) skip its test.
+	struct PlaneHorizon {
+		size_t bit; // Index in scene.unbounded
+		float a, b, c; // Positive toward the plane
+		float margin; // Against rounding near the horizon
+	};
+	vector<PlaneHorizon> horizons;
+	for (size_t i = 0; i < scene.unbounded.size() && i < 64; ++i) {
+		const ObjectType type = scene.unbounded[i].type;
+		if (type != ObjectType::Plane && type != ObjectType::Checkerboard) continue;
+		const auto* plane = static_cast<const Plane*>(scene.unbounded[i].object);
+
+		const float side = (plane->center - camera.position).dot(plane->normal);
+		if (abs(side) < 1e-4f) continue; // Camera on the plane
+		const Vec3 normal = side > 0.0f ? plane->normal : -plane->normal;
+
+		PlaneHorizon horizon{ i, normal.dot(right), normal.dot(up), normal.dot(forward), 0.0f };
+		horizon.margin = 1e-4f * (abs(horizon.a) * plane_width + abs(horizon.b) * plane_height + abs(horizon.c));
+		horizons.push_back(horizon);
+	}
+
+	// Bits of the unbounded objects a pixel of the row span (first and last column inclusive) may hit
+	const float invRenderWidth = 1.0f / static_cast<float>(renderWidth);
+	const float invRenderHeight = 1.0f / static_cast<float>(renderHeight);
+	const auto spanMask = [&](const size_t row, const size_t colFirst, const size_t colLast) {
+		uint64_t mask = ~uint64_t{ 0 };
+		const float y = ((row + 0.5f) * invRenderHeight - 0.5f) * plane_height;
+		const float xFirst = -((colFirst + 0.5f) * invRenderWidth - 0.5f) * plane_width;
+		const float xLast = -((colLast + 0.5f) * invRenderWidth - 0.5f) * plane_width;
+		for (const PlaneHorizon& horizon : horizons) {
+			const float rowTerm = horizon.b * y + horizon.c;
+			if (horizon.a * xFirst + rowTerm <= -horizon.margin && horizon.a * xLast + rowTerm <= -horizon.margin) mask &= ~(uint64_t{ 1 } << horizon.bit);
+		}
+		return mask;
+	};
+
+	// Pick the pixels to trace again, the others keep their color from the previous frame
+	const bool reusing = reuse != TemporalReuse::Off;
+	if (reusing) planReuse(camera, scene, renderWidth, renderHeight, aspect, plane_width, plane_height);
+	PixelHistory& h = history;
+	primaryRays = renderWidth * renderHeight - (reusing ? h.reusedPixels : 0);
+
+	// Edge sampling compares what neighboring pixels hit
+	const bool sampling = edgeSampler.budget > 0;
+	if (sampling) {
+		edgeSampler.ids.resize(renderWidth * renderHeight, PixelHistory::MISS);
+		edgeSampler.normals.resize(renderWidth * renderHeight * 3, 0.0f);
+	}
+
+	// Deferred frames trace into the G-buffer, and when only the lights changed since it was traced, just light it again
+	// (reflections need the surfaces hit further along, and reused pixels have no G-buffer entry)
+	GBuffer& g = gbuffer;
+	const bool deferredFrame = deferred && scene.maxBounces == 0 && !reusing;
+	const bool relight = deferredFrame && !rotate && g.valid && g.width == renderWidth && g.height == renderHeight && g.aspect == aspect
+		&& g.position[0] == camera.position.x && g.position[1] == camera.position.y && g.position[2] == camera.position.z
+		&& g.yawDegrees == camera.yawDegrees && g.pitchDegrees == camera.pitchDegrees && g.geometryClock == scene.geometryClock;
+	if (deferredFrame) {
+		const size_t count = (renderWidth * renderHeight + GBuffer::CHUNK - 1) / GBuffer::CHUNK * GBuffer::CHUNK;
+		g.ids.resize(count);
+		for (vector<float>* array : { &g.dists, &g.normalX, &g.normalY, &g.normalZ, &g.albedoR, &g.albedoG, &g.albedoB }) array->resize(count);
+	}
+	if (relight) primaryRays = 0;
+
+	// Shade a traced pixel (or store it in the G-buffer) and remember what it hit
+	std::atomic<size_t> reflectionRays{ 0 };
+	const auto storePixel = [&](const size_t row, const size_t col, const Ray& ray, const Hit& hit, ShadowCache& shadowCache, size_t& rays) {
+		const size_t i = row * renderWidth + col;
+		const Vec3 normal = hit.object && (deferredFrame || sampling) ? hit_normal(scene.types[hit.id], *hit.object, ray, hit.dist) : Vec3{};
+		if (deferredFrame) {
+			// Misses get zeros, which the shading pass multiplies with without producing NaNs
+			const Pixel color = hit.object ? color_at(scene.types[hit.id], *hit.object, ray.origin + ray.direction * hit.dist) : Pixel{ 0, 0, 0 };
+			g.ids[i] = hit.object ? hit.id : PixelHistory::MISS;
+			g.dists[i] = hit.object ? hit.dist : 0.0f;
+			g.normalX[i] = normal.x;
+			g.normalY[i] = normal.y;
+			g.normalZ[i] = normal.z;
+			g.albedoR[i] = color.r / RGB_MAX_FLOAT;
+			g.albedoG[i] = color.g / RGB_MAX_FLOAT;
+			g.albedoB[i] = color.b / RGB_MAX_FLOAT;
+		}
+		else {
+			const uint32_t seed = static_cast<uint32_t>(i);
+			const Pixel color = hit.object ? shade_path(scene, ray, hit, &shadowCache, seed, rays) : Pixel{ 0, 0, 0 };
+			if (hit.object) targetAt(row, col) = color;
+			if (reusing) {
+				h.ids[i] = hit.object ? hit.id : PixelHistory::MISS;
+				h.dists[i] = hit.dist;
+				h.colors[i] = color;
+				h.ages[i] = 0;
+			}
+		}
+		if (sampling) {
+			edgeSampler.ids[i] = hit.object ? hit.id : PixelHistory::MISS;
+			if (hit.object) {
+				edgeSampler.normals[i * 3] = normal.x;
+				edgeSampler.normals[i * 3 + 1] = normal.y;
+				edgeSampler.normals[i * 3 + 2] = normal.z;
+			}
+		}
+	};
+
+	// Split the image into tiles (every pixel is independent, so the result doesn't depend on tile order or thread count)
+	const size_t tilesX = (renderWidth + TILE_SIZE - 1) / TILE_SIZE;
+	const size_t tilesY = (renderHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+	const std::function<void(size_t)> renderTile = [&](const size_t tile) {
+		const size_t rowStart = (tile / tilesX) * TILE_SIZE;
+		const size_t colStart = (tile % tilesX) * TILE_SIZE;
+		const size_t rowEnd = min(rowStart + TILE_SIZE, renderHeight);
+		const size_t colEnd = min(colStart + TILE_SIZE, renderWidth);
+		ShadowCache shadowCache;
+		size_t tileRays = 0; // Reflection rays
+
+		if (rotate) {
+			for (size_t row = rowStart; row < rowEnd; ++row) {
+				for (size_t col = colStart; col < colEnd; ++col) {
+					const float* d = &cache.cameraSpace[(row * renderWidth + col) * 3];
+					const Vec3 w = (right * d[0]) + (up * d[1]) + (forward * d[2]);
+					float* out = &cache.world[(row * renderWidth + col) * 3];
+					out[0] = w.x;
+					out[1] = w.y;
+					out[2] = w.z;
+				}
+			}
+		}
+
+		if (packets) {
+			RayPacket packet;
+			for (size_t blockRow = rowStart; blockRow < rowEnd; blockRow += PACKET_SIZE) {
+				for (size_t blockCol = colStart; blockCol < colEnd; blockCol += PACKET_SIZE) {
+					const size_t numRows = min(PACKET_SIZE, rowEnd - blockRow);
+					const size_t numCols = min(PACKET_SIZE, colEnd - blockCol);
+
+					// planReuse marks whole packets, so checking the first pixel is enough
+					if (reusing && !h.retrace[blockRow * renderWidth + blockCol]) {
+						for (size_t r = 0; r < numRows; ++r) {
+							for (size_t c = 0; c < numCols; ++c) targetAt(blockRow + r, blockCol + c) = h.colors[(blockRow + r) * renderWidth + blockCol + c];
+						}
+						continue;
+					}
+
+					for (size_t r = 0; r < numRows; ++r) {
+						for (size_t c = 0; c < numCols; ++c) packet.directions[r * numCols + c] = primaryDirection(blockRow + r, blockCol + c);
+					}
+					packet.init(camera.position, numRows, numCols);
+					scene.closestHitPacket(packet);
+
+					for (size_t i = 0; i < packet.count; ++i) storePixel(blockRow + i / numCols, blockCol + i % numCols, packet.ray(i), packet.hits[i], shadowCache, tileRays);
+				}
+			}
+			reflectionRays += tileRays;
+			return;
+		}
+
+		// Cast rays for each pixel in the tile
+		for (size_t row = rowStart; row < rowEnd; ++row) {
+			const uint64_t unboundedMask = spanMask(row, colStart, colEnd - 1);
+			for (size_t col = colStart; col < colEnd; ++col) {
+				if (reusing && !h.retrace[row * renderWidth + col]) {
+					targetAt(row, col) = h.colors[row * renderWidth + col];
+					continue;
+				}
+
+				// Create ray from camera to pixel
+				const Ray ray{ camera.position, primaryDirection(row, col) };
+
+				// Find closest object
+				Hit hit;
+				scene.closestHit(ray, hit, unboundedMask);
+				storePixel(row, col, ray, hit, shadowCache, tileRays);
+			}
+		}
+		reflectionRays += tileRays;
+	};
+
+	if (!relight) {
+		if (pool) pool->run(tilesX * tilesY, renderTile);
+		else for (size_t tile = 0; tile < tilesX * tilesY; ++tile) renderTile(tile);
+	}
+	secondaryRays = reflectionRays;
+
+	if (deferredFrame) {
+		shadeGBuffer(camera, scene, renderWidth, renderHeight, target);
+		if (relight) ++g.relitFrames;
+
+		g.valid = true;
+		g.width = renderWidth;
+		g.height = renderHeight;
+		g.aspect = aspect;
+		g.position[0] = camera.position.x;
+		g.position[1] = camera.position.y;
+		g.position[2] = camera.position.z;
+		g.yawDegrees = camera.yawDegrees;
+		g.pitchDegrees = camera.pitchDegrees;
+		g.geometryClock = scene.geometryClock;
+	}
+
+	if (sampling) sampleEdges(camera, scene, renderWidth, renderHeight, plane_width, plane_height, target);
+
+	if (reusing) {
+		h.valid = true;
+		h.width = renderWidth;
+		h.height = renderHeight;
+		h.aspect = aspect;
+		h.position[0] = camera.position.x;
+		h.position[1] = camera.position.y;
+		h.position[2] = camera.position.z;
+		h.yawDegrees = camera.yawDegrees;
+		h.pitchDegrees = camera.pitchDegrees;
+		h.sceneClock = scene.changeClock;
+	}
+
+	// This frame is the first anti-aliasing sample, refine adds the others while the view holds still
+	if (maxSamples > 1) {
+		SampleAccumulator& acc = accumulator;
+		acc.valid = true;
+		acc.width = renderWidth;
+		acc.height = renderHeight;
+		acc.aspect = aspect;
+		acc.position[0] = camera.position.x;
+		acc.position[1] = camera.position.y;
+		acc.position[2] = camera.position.z;
+		acc.yawDegrees = camera.yawDegrees;
+		acc.pitchDegrees = camera.pitchDegrees;
+		acc.sceneClock = scene.changeClock;
+		acc.samples = 1;
+		acc.sums.resize(renderWidth * renderHeight * 3);
+		for (size_t i = 0; i < renderWidth * renderHeight; ++i) {
+			acc.sums[i * 3] = target[i].r;
+			acc.sums[i * 3 + 1] = target[i].g;
+			acc.sums[i * 3 + 2] = target[i].b;
+		}
+	}
+
+	if (scaled) upscale(renderWidth, renderHeight);
+}
+
+
+// Second pass of deferred shading: light the G-buffer with the scene lights (the lighting of shade_hit)
+// Pixels are lit in chunks, one light at a time over the whole chunk with FloatN::WIDTH pixels per instruction. Shadow
+// rays for the light are traced first, so the lighting itself is branch free. pow(x, 32) becomes five squarings,
+// which can differ from pow in the last bits.
+void Display3D::shadeGBuffer(const Camera& camera, const Scene& scene, const size_t renderWidth, const size_t renderHeight, vector<Pixel>& target) {
+	constexpr size_t CHUNK = GBuffer::CHUNK;
+	static_assert(CHUNK % FloatN::WIDTH == 0, "chunks are lit FloatN::WIDTH pixels at a time");
+	static_assert(SPECULAR_SHININESS == 32.0f, "the shading loop raises to the 32nd power by squaring");
+
+	const GBuffer& g = gbuffer;
+	const size_t count = renderWidth * renderHeight;
+	const size_t numChunks = (count + CHUNK - 1) / CHUNK;
+
+	const std::function<void(size_t)> shadeChunk = [&](const size_t chunk) {
+		const size_t first = chunk * CHUNK;
+		const size_t n = min(CHUNK, count - first);
+		const uint32_t* ids = &g.ids[first];
+		const float* dists = &g.dists[first];
+		const float* nx = &g.normalX[first];
+		const float* ny = &g.normalY[first];
+		const float* nz = &g.normalZ[first];
+		const float* ar = &g.albedoR[first];
+		const float* ag = &g.albedoG[first];
+		const float* ab = &g.albedoB[first];
+
+		// View directions of the chunk, unpacked from the ray cache (padding lanes are never lit)
+		alignas(64) float dx[CHUNK], dy[CHUNK], dz[CHUNK];
+		const float* directions = &rayCache.world[first * 3];
+		for (size_t i = 0; i < CHUNK; ++i) {
+			dx[i] = i < n ? directions[i * 3] : 0.0f;
+			dy[i] = i < n ? directions[i * 3 + 1] : 0.0f;
+			dz[i] = i < n ? directions[i * 3 + 2] : 1.0f;
+		}
+
+		alignas(64) float rTotal[CHUNK] = {}, gTotal[CHUNK] = {}, bTotal[CHUNK] = {};
+		alignas(64) float lit[CHUNK]; // 1 where the light reaches the pixel, 0 elsewhere
+		ShadowCache shadowCache;
+
+		for (size_t lightIndex = 0; lightIndex < scene.lights.size(); ++lightIndex) {
+			const Light& light = scene.lights[lightIndex];
+			const float lx = light.direction.x, ly = light.direction.y, lz = light.direction.z;
+
+			for (size_t i = 0; i < CHUNK; ++i) lit[i] = i < n && ids[i] != PixelHistory::MISS && nx[i] * lx + ny[i] * ly + nz[i] * lz > 0.0f;
+
+			if (scene.shadows != ShadowMode::Off) {
+				for (size_t i = 0; i < n; ++i) {
+					if (lit[i] == 0.0f) continue;
+
+					const Vec3 hitPoint = camera.position + Vec3{ dx[i], dy[i], dz[i] } * dists[i];
+					const Ray shadowRay{ hitPoint + Vec3{ nx[i], ny[i], nz[i] } * SHADOW_BIAS, light.direction };
+					bool blocked;
+					if (scene.shadows == ShadowMode::ClosestHit) {
+						Hit shadowHit;
+						scene.closestHit(shadowRay, shadowHit);
+						blocked = shadowHit.object != nullptr;
+					}
+					else {
+						const Object* uncached = nullptr;
+						blocked = scene.occluded(shadowRay, INFINITY, lightIndex < ShadowCache::MAX_LIGHTS ? shadowCache.lastOccluder[lightIndex] : uncached);
+					}
+					if (blocked) lit[i] = 0.0f;
+				}
+			}
+
+			// Diffuse (Lambertian) plus specular (Blinn-Phong), added in the order shade_hit adds them
+			const FloatN zero{ 0.0f }, lxN{ lx }, lyN{ ly }, lzN{ lz };
+			const FloatN cr{ static_cast<float>(light.color.r) }, cg{ static_cast<float>(light.color.g) }, cb{ static_cast<float>(light.color.b) };
+			for (size_t i = 0; i < CHUNK; i += FloatN::WIDTH) {
+				const FloatN nxI = FloatN::loadUnaligned(nx + i), nyI = FloatN::loadUnaligned(ny + i), nzI = FloatN::loadUnaligned(nz + i);
+				const FloatN diffuse = nxI * lxN + nyI * lyN + nzI * lzN;
+
+				const FloatN hx = lxN - FloatN::load(dx + i), hy = lyN - FloatN::load(dy + i), hz = lzN - FloatN::load(dz + i);
+				const FloatN len = sqrt(hx * hx + hy * hy + hz * hz);
+				const FloatN specularAngle = maxN(zero, nxI * (hx / len) + nyI * (hy / len) + nzI * (hz / len));
+				FloatN specular = specularAngle * specularAngle; // ^2
+				specular = specular * specular; // ^4
+				specular = specular * specular; // ^8
+				specular = specular * specular; // ^16
+				specular = specular * specular; // ^32
+
+				const MaskN reached = FloatN::load(lit + i) > zero;
+				const FloatN r = FloatN::load(rTotal + i), gr = FloatN::load(gTotal + i), b = FloatN::load(bTotal + i);
+				select(reached, r + FloatN::loadUnaligned(ar + i) * diffuse * cr + specular * cr, r).store(rTotal + i);
+				select(reached, gr + FloatN::loadUnaligned(ag + i) * diffuse * cg + specular * cg, gr).store(gTotal + i);
+				select(reached, b + FloatN::loadUnaligned(ab + i) * diffuse * cb + specular * cb, b).store(bTotal + i);
+			}
+		}
+
+		for (size_t i = 0; i < n; ++i) {
+			if (ids[i] == PixelHistory::MISS) continue;
+			target[first + i] = Pixel{
+				static_cast<u_char>(min(rTotal[i], RGB_MAX_FLOAT)),
+				static_cast<u_char>(min(gTotal[i], RGB_MAX_FLOAT)),
+				static_cast<u_char>(min(bTotal[i], RGB_MAX_FLOAT))
+			};
+		}
+	};
+
+	if (pool) pool->run(numChunks, shadeChunk);
+	else for (size_t chunk = 0; chunk < numChunks; ++chunk) shadeChunk(chunk);
+}
+
+
+// void draw_line_3d(Display3D& image, const Camera& camera, const Vec3& p0, const Vec3& p1, const Pixel& color) {
+// 	Vec3 forward, right, up;
+// 	get_camera_basis(camera, forward, right, up);
+// 	right = -right; // Invert right vector to match typical camera controls
+// 	up = -up; // Invert up vector to match typical camera controls
+
+// 	const size_t width = image.getNumCols();
+// 	const size_t height = image.getNumRows();
+// 	const float aspect = (width / 2.0f) / static_cast<float>(height);
+// 	constexpr float camera_to_plane = 1.0f;
+// 	const float plane_height = 2.0f * camera_to_plane * tan(degToRad(FOV * 0.5f));
+// 	const float plane_width = plane_height * aspect;
+
+// 	auto project = [&](const Vec3& pt) -> pair<int, int> {
+// 		Vec3 cam_to_pt = pt - camera.position;
+// 		float z = forward.dot(cam_to_pt);
+// 		if (z <= 0.1f) return { -1, -1 }; // Behind camera
+
+// 		float x = right.dot(cam_to_pt);
+// 		float y = up.dot(cam_to_pt);
+
+// 		// Perspective divide
+// 		float px = (x / z) * camera_to_plane;
+// 		float py = (y / z) * camera_to_plane;
+
+// 		int col = static_cast<int>((0.5f + px / plane_width) * width);
+// 		int row = static_cast<int>((0.5f - py / plane_height) * height);
+// 		return { row, col };
+// 		};
+
+// 	auto [row0, col0] = project(p0);
+// 	auto [row1, col1] = project(p1);
+
+// 	// Simple Bresenham's line algorithm
+// 	if (row0 >= 0 && col0 >= 0 && row1 >= 0 && col1 >= 0 &&
 // 		image.isWithinBounds(row0, col0) && image.isWithinBounds(row1, col1)) {
 // 		int dx = abs(col1 - col0), sx = col0 < col1 ? 1 : -1;
 // 		int dy = abs(row1 - row0), sy = row0 < row1 ? 1 : -1;
 // 		int err = (dx > dy ? dx : -dy) / 2, e2;
 
-// 		int x = col0, y = row0;
-// 		while (true) {
-// 			image.pixelAt(y, x) = color;
-// 			if (x == col1 && y == row1) break;
-// 			e2 = err;
-// 			if (e2 > -dx) {
-// 				err -= dy; x += sx;
-// 			}
-// 			if (e2 < dy) {
-// 				err += dx; y += sy;
-// 			}
-// 		}
-// 	}
-// }
+// 		int x = col0, y = row0;
+// 		while (true) {
+// 			image.pixelAt(y, x) = color;
+// 			if (x == col1 && y == row1) break;
+// 			e2 = err;
+// 			if (e2 > -dx) {
+// 				err -= dy; x += sx;
+// 			}
+// 			if (e2 < dy) {
+// 				err += dx; y += sy;
+// 			}
+// 		}
+// 	}
+// }
+
+struct KeyState {
+	// Pack key states into 11 bits
+	uint16_t packed = 0;
+
+	void clear() {
+		packed = 0;
+	}
+
+	// Set a key to pressed
+	void set(const int key) {
+		uint16_t mask = 0;
+		switch (key) {
+			case 'q':         mask = 0x001; break;
+
+			case 'w':         mask = 0x002; break;
+			case 'a':         mask = 0x004; break;
+			case 's':         mask = 0x008; break;
+			case 'd':         mask = 0x010; break;
+
+			case NCKEY_SPACE: mask = 0x020; break;
+			case 'x':         mask = 0x040; break;
+
+			case NCKEY_UP:    mask = 0x080; break;
+			case NCKEY_DOWN:  mask = 0x100; break;
+			case NCKEY_LEFT:  mask = 0x200; break;
+			case NCKEY_RIGHT: mask = 0x400; break;
+
+			default: return; // Ignore unsupported keys
+		}
+
+		packed |= mask;
+	}
+
+	// Functions to check if a key is pressed
+	bool q() const {
+		return packed & 0x001;
+	}
+
+	bool w() const {
+		return packed & 0x002;
+	}
+	bool a() const {
+		return packed & 0x004;
+	}
+	bool s() const {
+		return packed & 0x008;
+	}
+	bool d() const {
+		return packed & 0x010;
+	}
+
+	bool space() const {
+		return packed & 0x020;
+	}
+	bool x() const {
+		return packed & 0x040;
+	}
+
+	bool up() const {
+		return packed & 0x080;
+	}
+	bool down() const {
+		return packed & 0x100;
+	}
+	bool left() const {
+		return packed & 0x200;
+	}
+	bool right() const {
+		return packed & 0x400;
+	}
+};
+
+// Scaling applied when frames don't fit in the frame budget
+enum class ScalePolicy {
+	Off, // Always render at the requested scale
+	Step, // Drop the render scale a step when frames run over budget, raise it again when there is room
+	Hold, // Continuously steer the render scale so frames take a fixed share of the budget
+};
+
+// Paces the main loop to a target frame rate by sleeping until each frame's deadline (not for a fixed time)
+// and measures how long rendering and presenting take
+struct FramePacer {
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr float MIN_SCALE = 0.25f;
+	static constexpr float SCALE_STEP = 0.85f; // Multiplier when dropping resolution (divisor when raising it)
+	static constexpr size_t STEP_FRAMES = 5; // Consecutive over/under budget frames before the scale changes
+	static constexpr double HOLD_TARGET = 0.8; // Share of the frame budget the hold policy aims for
+	static constexpr double HOLD_GAIN = 0.3; // How far toward the ideal scale each frame moves
+	static constexpr float HOLD_DEADBAND = 0.02f; // Ignore smaller scale changes (avoids resizing every frame)
+
+	Clock::duration budget; // Zero when uncapped
+	ScalePolicy policy;
+	float scale; // Render scale to use for the next frame
+	float maxScale;
+
+	Clock::time_point frameStart, rendered, presented, deadline;
+	double renderMs = 0.0, presentMs = 0.0; // Last frame
+	double totalRenderMs = 0.0, totalPresentMs = 0.0;
+	size_t frames = 0;
+	size_t overBudget = 0, underBudget = 0; // Consecutive frame counts for the step policy
+
+	FramePacer(const double targetFps, const ScalePolicy p, const float initialScale)
+		: budget{ targetFps > 0.0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / targetFps)) : Clock::duration::zero() },
+		policy{ p }, scale{ initialScale }, maxScale{ initialScale }, deadline{ Clock::now() } {}
+
+	void beginFrame() {
+		frameStart = Clock::now();
+	}
+
+	void markRendered() {
+		rendered = Clock::now();
+		renderMs = std::chrono::duration<double, std::milli>(rendered - frameStart).count();
+		totalRenderMs += renderMs;
+	}
+
+	void markPresented() {
+		presented = Clock::now();
+		presentMs = std::chrono::duration<double, std::milli>(presented - rendered).count();
+		totalPresentMs += presentMs;
+		++frames;
+		adjustScale();
+	}
+
+	// Sleep until the next frame is due
+	void waitForNextFrame() {
+		if (budget == Clock::duration::zero()) return;
+
+		deadline += budget;
+		const Clock::time_point now = Clock::now();
+		if (deadline < now) deadline = now; // Fell behind, don't try to catch up with a burst of frames
+		std::this_thread::sleep_until(deadline);
+	}
+
+private:
+	void adjustScale() {
+		if (policy == ScalePolicy::Off || budget == Clock::duration::zero()) return;
+
+		const double budgetMs = std::chrono::duration<double, std::milli>(budget).count();
+		const double workMs = renderMs + presentMs;
+
+		if (policy == ScalePolicy::Hold) {
+			// Tracing cost grows with the pixel count (scale squared), so the scale that would have hit the target is
+			// scale * sqrt(target / work). Move part of the way there to ride out single slow frames.
+			if (workMs <= 0.0) return;
+			const double ideal = scale * std::sqrt(budgetMs * HOLD_TARGET / workMs);
+			const float next = clamp(static_cast<float>(scale + (ideal - scale) * HOLD_GAIN), MIN_SCALE, maxScale);
+			if (abs(next - scale) >= HOLD_DEADBAND || next == MIN_SCALE || next == maxScale) scale = next;
+			return;
+		}
+
+		overBudget = workMs > budgetMs * 0.9 ? overBudget + 1 : 0;
+		underBudget = workMs < budgetMs * 0.5 ? underBudget + 1 : 0;
+
+		if (overBudget >= STEP_FRAMES) {
+			scale = max(MIN_SCALE, scale * SCALE_STEP);
+			overBudget = 0;
+		}
+		else if (underBudget >= STEP_FRAMES) {
+			scale = min(maxScale, scale / SCALE_STEP);
+			underBudget = 0;
+		}
+	}
+};
+
+// Presents finished frames on a separate thread so the next frame renders while the terminal is being written
+// Frames alternate between two Display3D buffers handed over through atomics, so the renderer is never more than
+// one frame ahead of the terminal
+struct PresentPipeline {
+	Display3D* buffers[2];
+	notcurses* nc;
+
+	std::atomic<int> pending{ -1 }; // Finished buffer waiting for the presenter
+	std::atomic<int> presenting{ -1 }; // Buffer the presenter is writing to the terminal
+	std::atomic<bool> stopping{ false };
+	std::atomic<size_t> totalCellsTouched{ 0 };
+	int back = 0; // Buffer the renderer draws into next (only used by the render thread)
+	std::thread presenter;
+
+	PresentPipeline(Display3D& a, Display3D& b, notcurses* n) : buffers{ &a, &b }, nc{ n } {
+		presenter = std::thread{ [this]() { presentLoop(); } };
+	}
+
+	~PresentPipeline() {
+		drain();
+		stopping = true;
+		presenter.join();
+	}
+
+	PresentPipeline(const PresentPipeline&) = delete;
+	PresentPipeline& operator=(const PresentPipeline&) = delete;
+
+	// Buffer to render the next frame into (waits while the presenter is still writing it)
+	Display3D& backBuffer() {
+		waitUntil([this]() { return presenting.load() != back; });
+		return *buffers[back];
+	}
+
+	// Hand the back buffer to the presenter (waits until the previous frame was picked up)
+	void submit() {
+		waitUntil([this]() { return pending.load() == -1; });
+		pending.store(back);
+		back ^= 1;
+	}
+
+	// Wait until every submitted frame is on the terminal (call before touching the plane or resizing the buffers)
+	void drain() {
+		waitUntil([this]() { return pending.load() == -1 && presenting.load() == -1; });
+	}
+
+private:
+	// Spin briefly, then back off to short sleeps
+	template <typename Predicate>
+	static void waitUntil(const Predicate& ready) {
+		for (size_t spins = 0; !ready(); ++spins) {
+			if (spins < 64) std::this_thread::yield();
+			else std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+
+	void presentLoop() {
+		while (true) {
+			waitUntil([this]() { return stopping.load() || pending.load() != -1; });
+			if (pending.load() == -1) return; // Stopping with nothing left to present
+
+			// Claim the buffer before releasing the pending slot so the renderer never sees it as free
+			const int index = pending.load();
+			presenting.store(index);
+			pending.store(-1);
+
+			buffers[index]->present(nc);
+			totalCellsTouched += buffers[index]->output->cellsTouched;
+			notcurses_render(nc);
+
+			presenting.store(-1);
+		}
+	}
+};
+
+// Fill the built-in demo scene
+void create_scene(Scene& scene) {
+	vector<unique_ptr<Object>>& objects = scene.objects;
+	objects.emplace_back(make_unique<Plane>(Vec3{ 0, 25, 0 }, Vec3{ 0, 1, 0 }, Pixel{ 230, 230, 230 })); // Light gray ground plane
+	objects.back()->reflectivity = 0.25f; // Polished floor
+	objects.emplace_back(make_unique<CheckerboardPlane>(Vec3{ 100, -25, 0 }, Vec3{ 0, -1, 0.5 }, 10.0f, Pixel{ 200, 200, 200 }, Pixel{ 50, 50, 50 })); // Checkerboard tilted plane
+
+	objects.emplace_back(make_unique<Sphere>(Vec3{ 0, 0, 0 }, 25, Pixel{ 255, 255, 255 })); // White sphere
+	objects.emplace_back(make_unique<Sphere>(Vec3{ 30, 20, -15 }, 10, Pixel{ 255, 255, 140 })); // Light yellow sphere front, up, right of the first
+	objects.back()->reflectivity = 0.6f; // Mostly mirror (seen with --reflections)
+
+	objects.emplace_back(make_unique<Box>(Vec3{ 0, 10, 0 }, Vec3{ 20, 0, 0 }, Vec3{ 0, 40, 0 }, Vec3{ 0, 0, 30 }, Pixel{ 255, 255, 255 }));
+
+	// Create light sources (directional lights for now)
+	scene.lights = {
+		Light{Vec3{5, -10, 1}, Pixel{182, 34, 228}}, // Back top right (magenta light)
+		Light{Vec3{-10, 3, -1}, Pixel{24, 236, 238 }}, // Front bottom left (cyan light)
+		Light{Vec3{1, 4, -1}, Pixel{100, 100, 100 }}, // Front bottom right (dim white)
+
+		//Light{Vec3{1, -1, -1}, Pixel{ 255, 255, 255 }}, // Front top right (white)
+	};
+}
+
+// Fill a benchmark scene with a ground plane and a field of randomly placed spheres in front of the camera
+void create_sphere_field(Scene& scene, const size_t count) {
+	scene.objects.emplace_back(make_unique<Plane>(Vec3{ 0, 25, 0 }, Vec3{ 0, 1, 0 }, Pixel{ 230, 230, 230 })); // Light gray ground plane
+
+	std::mt19937 rng{ 1234 }; // Fixed seed so runs are comparable
+	std::uniform_real_distribution<float> x{ -200.0f, 200.0f }, y{ -100.0f, 20.0f }, z{ 0.0f, 800.0f }, radius{ 1.0f, 4.0f };
+	std::uniform_int_distribution<int> channel{ 60, 255 };
+	for (size_t i = 0; i < count; ++i) {
+		const Pixel color{ static_cast<u_char>(channel(rng)), static_cast<u_char>(channel(rng)), static_cast<u_char>(channel(rng)) };
+		scene.objects.emplace_back(make_unique<Sphere>(Vec3{ x(rng), y(rng), z(rng) }, radius(rng), color));
+	}
+
+	scene.lights = {
+		Light{Vec3{5, -10, 1}, Pixel{182, 34, 228}}, // Back top right (magenta light)
+		Light{Vec3{-10, 3, -1}, Pixel{24, 236, 238 }}, // Front bottom left (cyan light)
+		Light{Vec3{1, 4, -1}, Pixel{100, 100, 100 }}, // Front bottom right (dim white)
+	};
+}
+
+//
+// Scene files
+//
+
+// Text scenes have one entry per line, values separated by whitespace, and # comments:
+//   camera       px py pz  yaw pitch
+//   light        dx dy dz  r g b
+//   plane        cx cy cz  nx ny nz  r g b
+//   checkerboard cx cy cz  nx ny nz  cell_size  r g b  r g b (light and dark cells)
+//   box          cx cy cz  ux uy uz  vx vy vz  wx wy wz  r g b (full edge vectors)
+//   sphere       cx cy cz  radius  r g b
+//   mesh         path  r g b (OBJ or PLY file, relative to the scene file, no spaces)
+//   material     reflectivity roughness (applies to the object on the line before)
+//   define       name  <object entry> (geometry for instances, not part of the scene itself)
+//   instance     name  tx ty tz  rx ry rz  sx sy sz (copy of a defined geometry, scaled, turned about x, y, z in
+//                degrees, then moved; it takes the geometry's material unless a material line follows)
+// Objects get their index in the scene in file order.
+//
+// Binary scenes (.bscene) hold the same entries as fixed-size records in host byte order and are read straight from a
+// memory mapping: a header, the lights, then runs of objects of one type. Runs keep the object order, and a file of
+// a million spheres is a single run. A last run of material records (version 2) holds the objects with non-default
+// materials by index.
+
+constexpr char SCENE_MAGIC[8] = { 'D', '3', 'D', 'S', 'C', 'E', 'N', 'E' };
+constexpr uint32_t SCENE_VERSION = 2; // Version 1 files (no materials) are still read
+
+enum class SceneRecordType : uint32_t {
+	None = 0, // Object types scene files can't hold
+	Plane = 1,
+	Checkerboard = 2,
+	Box = 3,
+	Sphere = 4,
+	Material = 5, // Not an object, sets the material of an object read before
+	Mesh = 6, // Only in text scenes, which reference the mesh file
+	Instance = 7, // Only in text scenes
+};
+
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t hasCamera;
+	float camera[5]; // Position, yaw, pitch
+	uint32_t numLights;
+	uint32_t numRuns;
+	uint32_t numObjects;
+};
+
+struct SceneRunHeader {
+	uint32_t type; // SceneRecordType
+	uint32_t count;
+};
+
+// Colors are padded to 4 bytes so every record stays float aligned
+struct LightRecord {
+	float direction[3];
+	uint8_t color[4];
+};
+
+struct PlaneRecord {
+	float center[3], normal[3];
+	uint8_t color[4];
+};
+
+struct CheckerboardRecord {
+	float center[3], normal[3];
+	float cellSize;
+	uint8_t lightColor[4], darkColor[4];
+};
+
+struct BoxRecord {
+	float center[3], u[3], v[3], w[3];
+	uint8_t color[4];
+};
+
+struct SphereRecord {
+	float center[3];
+	float radius;
+	uint8_t color[4];
+};
+
+struct MaterialRecord {
+	uint32_t object; // Index of the object in the file
+	float reflectivity, roughness;
+};
+
+static_assert(sizeof(SceneFileHeader) == 48 && sizeof(SceneRunHeader) == 8 && sizeof(LightRecord) == 16 && sizeof(PlaneRecord) == 28
+	&& sizeof(CheckerboardRecord) == 36 && sizeof(BoxRecord) == 52 && sizeof(SphereRecord) == 20 && sizeof(MaterialRecord) == 12,
+	"Scene records must not be padded");
+
+// Read-only memory mapping of a whole file
+struct MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+	bool valid = false;
+
+	explicit MappedFile(const std::string& path) {
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0) {
+			size = static_cast<size_t>(info.st_size);
+			if (size == 0) valid = true;
+			else {
+				void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapped != MAP_FAILED) {
+					data = static_cast<const char*>(mapped);
+					valid = true;
+					madvise(mapped, size, MADV_SEQUENTIAL);
+				}
+			}
+		}
+		close(fd); // The mapping stays valid
+	}
+
+	~MappedFile() {
+		if (data) munmap(const_cast<char*>(data), size);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+};
+
+Vec3 vec_from(const float v[3]) {
+	return Vec3{ v[0], v[1], v[2] };
+}
+
+Pixel pixel_from(const uint8_t c[4]) {
+	return Pixel{ c[0], c[1], c[2] };
+}
+
+// Reads consecutive records of a mapped file (records are read in place, the mapping is page aligned)
+struct RecordCursor {
+	const MappedFile& file;
+	size_t offset = 0;
+	bool truncated = false;
+
+	// Pointer to the next count records, or null when the file is too short
+	template <typename T>
+	const T* take(const size_t count) {
+		if (truncated || (file.size - offset) / sizeof(T) < count) {
+			truncated = true;
+			return nullptr;
+		}
+		const T* records = reinterpret_cast<const T*>(file.data + offset);
+		offset += count * sizeof(T);
+		return records;
+	}
+};
+
+// Meshes
+// Mesh files are parsed straight from the mapping into the vertex and index arrays (no per-line strings), and polygons
+// are split into triangle fans.
+
+// Wavefront OBJ: "v x y z" vertices and "f" faces with 1-based (or negative, relative to the end) vertex indices that
+// may carry texture and normal indices (a/t/n). Other entries are skipped.
+bool load_obj(const MappedFile& file, const std::string& path, vector<Vec3>& vertices, vector<uint32_t>& indices) {
+	const char* cursor = file.data;
+	const char* const fileEnd = file.data + file.size;
+	size_t lineNumber = 0;
+	vector<uint32_t> polygon;
+
+	while (cursor < fileEnd) {
+		const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', fileEnd - cursor));
+		if (!lineEnd) lineEnd = fileEnd;
+		const char* p = cursor;
+		cursor = lineEnd + 1;
+		++lineNumber;
+
+		const auto skipSpace = [&]() {
+			while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+		};
+		skipSpace();
+		if (lineEnd - p < 2 || (p[1] != ' ' && p[1] != '\t')) continue; // Not "v" or "f" (vn, vt, comments, ...)
+
+		bool ok = true;
+		const char kind = *p++;
+		if (kind == 'v') {
+			float xyz[3];
+			for (float& value : xyz) {
+				skipSpace();
+				const auto result = std::from_chars(p, lineEnd, value);
+				ok &= result.ec == std::errc{};
+				p = result.ptr;
+			}
+			vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+		}
+		else if (kind == 'f') {
+			polygon.clear();
+			while (ok) {
+				skipSpace();
+				if (p == lineEnd) break;
+				long long index;
+				const auto result = std::from_chars(p, lineEnd, index);
+				ok = result.ec == std::errc{} && index != 0;
+				p = result.ptr;
+				while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r') ++p; // Texture and normal indices
+				polygon.push_back(static_cast<uint32_t>(index < 0 ? static_cast<long long>(vertices.size()) + index : index - 1));
+			}
+			ok &= polygon.size() >= 3;
+			for (size_t i = 1; ok && i + 1 < polygon.size(); ++i) {
+				indices.push_back(polygon[0]);
+				indices.push_back(polygon[i]);
+				indices.push_back(polygon[i + 1]);
+			}
+		}
+
+		if (!ok) {
+			std::cerr << path << ":" << lineNumber << ": malformed " << (kind == 'v' ? "vertex" : "face") << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+enum class PlyType { Invalid, Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+PlyType ply_type(const std::string_view name) {
+	if (name == "char" || name == "int8") return PlyType::Int8;
+	if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+	if (name == "short" || name == "int16") return PlyType::Int16;
+	if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+	if (name == "int" || name == "int32") return PlyType::Int32;
+	if (name == "uint" || name == "uint32") return PlyType::UInt32;
+	if (name == "float" || name == "float32") return PlyType::Float32;
+	if (name == "double" || name == "float64") return PlyType::Float64;
+	return PlyType::Invalid;
+}
+
+// Reads PLY values one at a time, from ascii text or little endian binary
+struct PlyReader {
+	const char* p;
+	const char* end;
+	bool binary;
+	bool failed = false;
+
+	template <typename T>
+	double read() {
+		if (static_cast<size_t>(end - p) < sizeof(T)) {
+			failed = true;
+			return 0.0;
+		}
+		T value;
+		memcpy(&value, p, sizeof(T));
+		p += sizeof(T);
+		return static_cast<double>(value);
+	}
+
+	double next(const PlyType type) {
+		if (binary) {
+			switch (type) {
+				case PlyType::Int8:    return read<int8_t>();
+				case PlyType::UInt8:   return read<uint8_t>();
+				case PlyType::Int16:   return read<int16_t>();
+				case PlyType::UInt16:  return read<uint16_t>();
+				case PlyType::Int32:   return read<int32_t>();
+				case PlyType::UInt32:  return read<uint32_t>();
+				case PlyType::Float32: return read<float>();
+				case PlyType::Float64: return read<double>();
+				case PlyType::Invalid: break;
+			}
+			failed = true;
+			return 0.0;
+		}
+
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+		double value = 0.0;
+		const auto result = std::from_chars(p, end, value);
+		if (result.ec != std::errc{}) failed = true;
+		p = result.ptr;
+		return value;
+	}
+};
+
+// PLY, ascii or binary_little_endian: vertex x, y, z and face vertex index lists (other properties and elements are skipped)
+bool load_ply(const MappedFile& file, const std::string& path, vector<Vec3>& vertices, vector<uint32_t>& indices) {
+	struct Property {
+		std::string name;
+		PlyType type; // Item type for lists
+		PlyType countType; // Invalid unless the property is a list
+	};
+	struct Element {
+		std::string name;
+		size_t count;
+		vector<Property> properties;
+	};
+
+	// Header, one keyword per line up to end_header
+	const char* cursor = file.data;
+	const char* const fileEnd = file.data + file.size;
+	vector<Element> elements;
+	bool binary = false, headerDone = false;
+	while (cursor < fileEnd && !headerDone) {
+		const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', fileEnd - cursor));
+		if (!lineEnd) lineEnd = fileEnd;
+		std::string_view line{ cursor, static_cast<size_t>(lineEnd - cursor) };
+		cursor = lineEnd + 1;
+		if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+		vector<std::string_view> words;
+		for (size_t start = 0; start < line.size();) {
+			const size_t stop = min(line.find(' ', start), line.size());
+			if (stop > start) words.push_back(line.substr(start, stop - start));
+			start = stop + 1;
+		}
+		if (words.empty()) continue;
+
+		bool ok = true;
+		if (words[0] == "format") {
+			ok = words.size() >= 2 && (words[1] == "ascii" || words[1] == "binary_little_endian");
+			binary = ok && words[1] == "binary_little_endian";
+		}
+		else if (words[0] == "element") {
+			size_t count = 0;
+			ok = words.size() == 3 && std::from_chars(words[2].data(), words[2].data() + words[2].size(), count).ec == std::errc{};
+			if (ok) elements.push_back(Element{ std::string{ words[1] }, count, {} });
+		}
+		else if (words[0] == "property") {
+			ok = !elements.empty();
+			if (ok && words.size() == 5 && words[1] == "list") elements.back().properties.push_back(Property{ std::string{ words[4] }, ply_type(words[3]), ply_type(words[2]) });
+			else if (ok && words.size() == 3) elements.back().properties.push_back(Property{ std::string{ words[2] }, ply_type(words[1]), PlyType::Invalid });
+			else ok = false;
+			ok = ok && elements.back().properties.back().type != PlyType::Invalid;
+		}
+		else if (words[0] == "end_header") {
+			headerDone = true;
+		}
+		if (!ok) {
+			std::cerr << path << ": unsupported PLY header line '" << line << "'\n";
+			return false;
+		}
+	}
+	if (!headerDone) {
+		std::cerr << path << ": missing end_header\n";
+		return false;
+	}
+
+	PlyReader reader{ cursor, fileEnd, binary };
+	vector<uint32_t> polygon;
+	for (const Element& element : elements) {
+		const bool isVertex = element.name == "vertex", isFace = element.name == "face";
+
+		// Counts come from the header: every property of an item takes at least a byte, so more items than bytes left is
+		// a corrupt file (checked before reserving)
+		const size_t remaining = static_cast<size_t>(reader.end - reader.p);
+		if (element.properties.empty() ? element.count != 0 : element.count > remaining / element.properties.size()) {
+			std::cerr << path << ": PLY element '" << element.name << "' counts more items than the file holds\n";
+			return false;
+		}
+		if (isVertex) vertices.reserve(vertices.size() + element.count);
+		if (isFace) indices.reserve(indices.size() + element.count * 3);
+
+		for (size_t item = 0; item < element.count && !reader.failed; ++item) {
+			float xyz[3] = {};
+			for (const Property& property : element.properties) {
+				if (property.countType == PlyType::Invalid) {
+					const double value = reader.next(property.type);
+					if (isVertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z') xyz[property.name[0] - 'x'] = static_cast<float>(value);
+					continue;
+				}
+
+				const double listCount = reader.next(property.countType);
+				if (!(listCount >= 0.0 && listCount <= static_cast<double>(reader.end - reader.p))) {
+					reader.failed = true; // Negative, or more items than bytes left
+					break;
+				}
+				const size_t count = static_cast<size_t>(listCount);
+				const bool faceIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+				polygon.clear();
+				for (size_t i = 0; i < count && !reader.failed; ++i) {
+					const double index = reader.next(property.type);
+					if (!faceIndices) continue;
+					if (!(index >= 0.0 && index <= static_cast<double>(UINT32_MAX))) reader.failed = true;
+					else polygon.push_back(static_cast<uint32_t>(index));
+				}
+				for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+					indices.push_back(polygon[0]);
+					indices.push_back(polygon[i]);
+					indices.push_back(polygon[i + 1]);
+				}
+			}
+			if (isVertex) vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+		}
+	}
+
+	if (reader.failed) {
+		std::cerr << path << ": PLY data is truncated or malformed\n";
+		return false;
+	}
+	return true;
+}
+
+// Read the vertices and triangles of an OBJ or PLY file (told apart by the PLY magic)
+bool read_mesh_file(const std::string& path, vector<Vec3>& vertices, vector<uint32_t>& indices) {
+	const MappedFile file{ path };
+	if (!file.valid) {
+		std::cerr << "Failed to open " << path << "\n";
+		return false;
+	}
+
+	const bool ply = file.size >= 4 && memcmp(file.data, "ply", 3) == 0 && (file.data[3] == '\n' || file.data[3] == '\r');
+	return ply ? load_ply(file, path, vertices, indices) : load_obj(file, path, vertices, indices);
+}
+
+// Build a mesh from its vertices and triangles, remembering the file it came from
+unique_ptr<Mesh> make_mesh(const std::string& path, const vector<Vec3>& vertices, const vector<uint32_t>& indices, const Pixel& color) {
+	auto mesh = make_unique<Mesh>(vertices, indices, color);
+	if (mesh->triangles.empty()) {
+		std::cerr << path << ": no triangles\n";
+		return nullptr;
+	}
+
+	char* absolute = realpath(path.c_str(), nullptr); // Saved scenes can be written anywhere
+	mesh->path = absolute ? absolute : path;
+	free(absolute);
+	return mesh;
+}
+
+unique_ptr<Mesh> load_mesh_file(const std::string& path, const Pixel& color) {
+	vector<Vec3> vertices;
+	vector<uint32_t> indices;
+	if (!read_mesh_file(path, vertices, indices)) return nullptr;
+	return make_mesh(path, vertices, indices, color);
+}
+
+bool load_binary_scene(const MappedFile& file, const std::string& path, Scene& scene, Camera& camera) {
+	RecordCursor cursor{ file };
+
+	const SceneFileHeader* header = cursor.take<SceneFileHeader>(1);
+	if (!header || header->version < 1 || header->version > SCENE_VERSION) {
+		std::cerr << path << ": unsupported binary scene version\n";
+		return false;
+	}
+
+	if (header->hasCamera) camera = Camera{ vec_from(header->camera), header->camera[3], header->camera[4] };
+
+	const LightRecord* lights = cursor.take<LightRecord>(header->numLights);
+	for (size_t i = 0; lights && i < header->numLights; ++i) scene.lights.emplace_back(vec_from(lights[i].direction), pixel_from(lights[i].color));
+
+	vector<unique_ptr<Object>>& objects = scene.objects;
+	const size_t firstObject = objects.size(); // No reserve: numObjects is only trusted once the records are read
+	for (uint32_t run = 0; run < header->numRuns && !cursor.truncated; ++run) {
+		const SceneRunHeader* runHeader = cursor.take<SceneRunHeader>(1);
+		if (!runHeader) break;
+
+		const size_t count = runHeader->count;
+		switch (static_cast<SceneRecordType>(runHeader->type)) {
+			case SceneRecordType::Plane:
+				if (const PlaneRecord* r = cursor.take<PlaneRecord>(count)) {
+					for (size_t i = 0; i < count; ++i) objects.emplace_back(make_unique<Plane>(vec_from(r[i].center), vec_from(r[i].normal), pixel_from(r[i].color)));
+				}
+				break;
+			case SceneRecordType::Checkerboard:
+				if (const CheckerboardRecord* r = cursor.take<CheckerboardRecord>(count)) {
+					for (size_t i = 0; i < count; ++i) {
+						objects.emplace_back(make_unique<CheckerboardPlane>(vec_from(r[i].center), vec_from(r[i].normal), r[i].cellSize,
+							pixel_from(r[i].lightColor), pixel_from(r[i].darkColor)));
+					}
+				}
+				break;
+			case SceneRecordType::Box:
+				if (const BoxRecord* r = cursor.take<BoxRecord>(count)) {
+					for (size_t i = 0; i < count; ++i) {
+						objects.emplace_back(make_unique<Box>(vec_from(r[i].center), vec_from(r[i].u), vec_from(r[i].v), vec_from(r[i].w), pixel_from(r[i].color)));
+					}
+				}
+				break;
+			case SceneRecordType::Sphere:
+				if (const SphereRecord* r = cursor.take<SphereRecord>(count)) {
+					for (size_t i = 0; i < count; ++i) objects.emplace_back(make_unique<Sphere>(vec_from(r[i].center), r[i].radius, pixel_from(r[i].color)));
+				}
+				break;
+			case SceneRecordType::Material:
+				if (const MaterialRecord* r = cursor.take<MaterialRecord>(count)) {
+					for (size_t i = 0; i < count; ++i) {
+						if (firstObject + r[i].object >= objects.size()) {
+							std::cerr << path << ": material for missing object " << r[i].object << "\n";
+							return false;
+						}
+						Object& object = *objects[firstObject + r[i].object];
+						object.reflectivity = r[i].reflectivity;
+						object.roughness = r[i].roughness;
+					}
+				}
+				break;
+			default:
+				std::cerr << path << ": unknown object type " << runHeader->type << "\n";
+				return false;
+		}
+	}
+
+	if (cursor.truncated) {
+		std::cerr << path << ": file is truncated\n";
+		return false;
+	}
+	if (objects.size() - firstObject != header->numObjects) {
+		std::cerr << path << ": header counts " << header->numObjects << " objects but the file holds " << objects.size() - firstObject << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool load_text_scene(const MappedFile& file, const std::string& path, Scene& scene, Camera& camera) {
+	const char* cursor = file.data;
+	const char* const fileEnd = file.data + file.size;
+	size_t lineNumber = 0;
+	Object* last = nullptr; // Object of the line before, for materials
+	vector<std::pair<std::string, std::shared_ptr<Object>>> geometries; // Defined for instances, by name
+
+	while (cursor < fileEnd) {
+		const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', fileEnd - cursor));
+		if (!lineEnd) lineEnd = fileEnd;
+		const char* p = cursor;
+		cursor = lineEnd + 1;
+		++lineNumber;
+
+		const auto skipSpace = [&]() {
+			while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+			if (p < lineEnd && *p == '#') p = lineEnd; // Comment until the end of the line
+		};
+		const auto number = [&](float& value) {
+			skipSpace();
+			if (p < lineEnd && *p == '+') ++p; // from_chars doesn't take a plus sign
+			const auto result = std::from_chars(p, lineEnd, value);
+			if (result.ec != std::errc{}) return false;
+			p = result.ptr;
+			return true;
+		};
+		const auto vec = [&](Vec3& v) {
+			return number(v.x) && number(v.y) && number(v.z);
+		};
+		const auto color = [&](Pixel& c) {
+			u_char* channels[3] = { &c.r, &c.g, &c.b };
+			for (u_char* channel : channels) {
+				skipSpace();
+				int value;
+				const auto result = std::from_chars(p, lineEnd, value);
+				if (result.ec != std::errc{} || value < 0 || value > 255) return false;
+				*channel = static_cast<u_char>(value);
+				p = result.ptr;
+			}
+			return true;
+		};
+
+		const auto word = [&]() {
+			skipSpace();
+			const char* start = p;
+			while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#') ++p;
+			return std::string_view{ start, static_cast<size_t>(p - start) };
+		};
+
+		skipSpace();
+		if (p == lineEnd) continue; // Blank line or comment
+
+		std::string_view keyword = word();
+
+		// A definition is an object entry whose object goes to the named geometries instead of the scene
+		std::string_view defineName;
+		if (keyword == "define") {
+			defineName = word();
+			keyword = word();
+			const bool isObject = keyword == "sphere" || keyword == "plane" || keyword == "checkerboard" || keyword == "box" || keyword == "mesh";
+			if (defineName.empty() || !isObject) {
+				std::cerr << path << ":" << lineNumber << ": malformed define (needs a name and an object entry)\n";
+				return false;
+			}
+		}
+
+		const size_t objectCount = scene.objects.size();
+		bool ok = false;
+		Vec3 a, b, c, d;
+		float value, yaw;
+		Pixel color1, color2;
+		if (keyword == "sphere") {
+			ok = vec(a) && number(value) && color(color1);
+			if (ok) scene.objects.emplace_back(make_unique<Sphere>(a, value, color1));
+		}
+		else if (keyword == "plane") {
+			ok = vec(a) && vec(b) && color(color1);
+			if (ok) scene.objects.emplace_back(make_unique<Plane>(a, b, color1));
+		}
+		else if (keyword == "checkerboard") {
+			ok = vec(a) && vec(b) && number(value) && color(color1) && color(color2);
+			if (ok) scene.objects.emplace_back(make_unique<CheckerboardPlane>(a, b, value, color1, color2));
+		}
+		else if (keyword == "box") {
+			ok = vec(a) && vec(b) && vec(c) && vec(d) && color(color1);
+			if (ok) scene.objects.emplace_back(make_unique<Box>(a, b, c, d, color1));
+		}
+		else if (keyword == "mesh") {
+			skipSpace();
+			const char* pathStart = p;
+			while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r') ++p;
+			std::string meshPath{ pathStart, static_cast<size_t>(p - pathStart) };
+			ok = !meshPath.empty() && color(color1);
+			if (ok) {
+				const size_t slash = path.rfind('/');
+				if (meshPath[0] != '/' && slash != std::string::npos) meshPath = path.substr(0, slash + 1) + meshPath;
+				unique_ptr<Mesh> mesh = load_mesh_file(meshPath, color1);
+				if (!mesh) return false;
+				scene.objects.emplace_back(std::move(mesh));
+			}
+		}
+		else if (keyword == "instance") {
+			const std::string_view name = word();
+			const auto geometry = std::find_if(geometries.begin(), geometries.end(), [&](const auto& g) { return g.first == name; });
+			if (geometry == geometries.end()) {
+				std::cerr << path << ":" << lineNumber << ": unknown geometry '" << name << "'\n";
+				return false;
+			}
+			ok = vec(a) && vec(b) && vec(c) && c.x != 0.0f && c.y != 0.0f && c.z != 0.0f;
+			if (ok) scene.objects.emplace_back(make_unique<Instance>(geometry->second, geometry->first, c, b, a));
+		}
+		else if (keyword == "material") {
+			ok = last && number(value) && number(yaw);
+			if (ok) {
+				last->reflectivity = value;
+				last->roughness = yaw;
+			}
+		}
+		else if (keyword == "light") {
+			ok = vec(a) && color(color1);
+			if (ok) scene.lights.emplace_back(a, color1);
+		}
+		else if (keyword == "camera") {
+			ok = vec(a) && number(yaw) && number(value);
+			if (ok) camera = Camera{ a, yaw, value };
+		}
+		else {
+			std::cerr << path << ":" << lineNumber << ": unknown entry '" << keyword << "'\n";
+			return false;
+		}
+
+		skipSpace();
+		if (!ok || p != lineEnd) {
+			std::cerr << path << ":" << lineNumber << ": malformed " << keyword << "\n";
+			return false;
+		}
+
+		if (scene.objects.size() > objectCount) last = scene.objects.back().get();
+		if (!defineName.empty()) {
+			geometries.emplace_back(std::string{ defineName }, std::move(scene.objects.back()));
+			scene.objects.pop_back();
+			last = geometries.back().second.get();
+		}
+	}
+
+	return true;
+}
+
+// Add the objects and lights of a scene file (text or binary) to the scene, and set the camera if the file has one
+bool load_scene_file(const std::string& path, Scene& scene, Camera& camera) {
+	const MappedFile file{ path };
+	if (!file.valid) {
+		std::cerr << "Failed to open " << path << "\n";
+		return false;
+	}
+
+	if (file.size >= sizeof(SCENE_MAGIC) && memcmp(file.data, SCENE_MAGIC, sizeof(SCENE_MAGIC)) == 0) return load_binary_scene(file, path, scene, camera);
+	return load_text_scene(file, path, scene, camera);
+}
 
-struct KeyState {
-	// Pack key states into 11 bits
-	uint16_t packed = 0;
+SceneRecordType record_type(const Object& object) {
+	if (dynamic_cast<const CheckerboardPlane*>(&object)) return SceneRecordType::Checkerboard; // Before Plane, its base
+	if (dynamic_cast<const Plane*>(&object)) return SceneRecordType::Plane;
+	if (dynamic_cast<const Box*>(&object)) return SceneRecordType::Box;
+	if (dynamic_cast<const Sphere*>(&object)) return SceneRecordType::Sphere;
+	if (dynamic_cast<const Mesh*>(&object)) return SceneRecordType::Mesh;
+	if (dynamic_cast<const Instance*>(&object)) return SceneRecordType::Instance;
+	return SceneRecordType::None;
+}
 
-	void clear() {
-		packed = 0;
+void copy_to(float out[3], const Vec3& v) {
+	out[0] = v.x;
+	out[1] = v.y;
+	out[2] = v.z;
+}
+
+void copy_to(uint8_t out[4], const Pixel& c) {
+	out[0] = c.r;
+	out[1] = c.g;
+	out[2] = c.b;
+	out[3] = 0;
+}
+
+bool write_binary_scene(const Scene& scene, const Camera& camera, const std::string& path) {
+	std::ofstream file{ path, std::ios::binary };
+
+	// Group consecutive objects of the same type into runs
+	vector<SceneRunHeader> runs;
+	vector<MaterialRecord> materials;
+	for (size_t i = 0; i < scene.objects.size(); ++i) {
+		const Object& object = *scene.objects[i];
+		const uint32_t type = static_cast<uint32_t>(record_type(object));
+		if (runs.empty() || runs.back().type != type) runs.push_back(SceneRunHeader{ type, 0 });
+		++runs.back().count;
+		if (object.reflectivity != 0.0f || object.roughness != 0.0f) materials.push_back(MaterialRecord{ static_cast<uint32_t>(i), object.reflectivity, object.roughness });
 	}
 
-	// Set a key to pressed
-	void set(const int key) {
-		uint16_t mask = 0;
-		switch (key) {
-			case 'q':         mask = 0x001; break;
+	SceneFileHeader header{};
+	memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+	header.version = SCENE_VERSION;
+	header.hasCamera = 1;
+	copy_to(header.camera, camera.position);
+	header.camera[3] = camera.yawDegrees;
+	header.camera[4] = camera.pitchDegrees;
+	header.numLights = static_cast<uint32_t>(scene.lights.size());
+	header.numRuns = static_cast<uint32_t>(runs.size() + (materials.empty() ? 0 : 1));
+	header.numObjects = static_cast<uint32_t>(scene.objects.size());
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (const Light& light : scene.lights) {
+		LightRecord record;
+		copy_to(record.direction, light.direction);
+		copy_to(record.color, light.color);
+		file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+	}
 
-			case 'w':         mask = 0x002; break;
-			case 'a':         mask = 0x004; break;
-			case 's':         mask = 0x008; break;
-			case 'd':         mask = 0x010; break;
+	size_t next = 0;
+	for (const SceneRunHeader& run : runs) {
+		file.write(reinterpret_cast<const char*>(&run), sizeof(run));
+
+		for (size_t i = next; i < next + run.count; ++i) {
+			const Object& object = *scene.objects[i];
+			switch (static_cast<SceneRecordType>(run.type)) {
+				case SceneRecordType::Plane: {
+					const auto& plane = static_cast<const Plane&>(object);
+					PlaneRecord record;
+					copy_to(record.center, plane.center);
+					copy_to(record.normal, plane.normal);
+					copy_to(record.color, plane.color);
+					file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+					break;
+				}
+				case SceneRecordType::Checkerboard: {
+					const auto& plane = static_cast<const CheckerboardPlane&>(object);
+					CheckerboardRecord record;
+					copy_to(record.center, plane.center);
+					copy_to(record.normal, plane.normal);
+					record.cellSize = plane.cellSize;
+					copy_to(record.lightColor, plane.lightColor);
+					copy_to(record.darkColor, plane.darkColor);
+					file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+					break;
+				}
+				case SceneRecordType::Box: {
+					const auto& box = static_cast<const Box&>(object);
+					BoxRecord record;
+					copy_to(record.center, box.center);
+					copy_to(record.u, box.u * (box.hu * 2.0f));
+					copy_to(record.v, box.v * (box.hv * 2.0f));
+					copy_to(record.w, box.w * (box.hw * 2.0f));
+					copy_to(record.color, box.color);
+					file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+					break;
+				}
+				case SceneRecordType::Sphere: {
+					const auto& sphere = static_cast<const Sphere&>(object);
+					SphereRecord record;
+					copy_to(record.center, sphere.center);
+					record.radius = sphere.radius;
+					copy_to(record.color, sphere.color);
+					file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+					break;
+				}
+				case SceneRecordType::Mesh:
+				case SceneRecordType::Instance:
+					std::cerr << "Binary scene files can't hold meshes or instances (object " << i << "), save the scene as text\n";
+					return false;
+				case SceneRecordType::Material:
+				case SceneRecordType::None:
+					std::cerr << "Scene files can't hold object " << i << "\n";
+					return false;
+			}
+		}
+		next += run.count;
+	}
 
-			case NCKEY_SPACE: mask = 0x020; break;
-			case 'x':         mask = 0x040; break;
+	if (!materials.empty()) {
+		const SceneRunHeader run{ static_cast<uint32_t>(SceneRecordType::Material), static_cast<uint32_t>(materials.size()) };
+		file.write(reinterpret_cast<const char*>(&run), sizeof(run));
+		file.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(MaterialRecord));
+	}
 
-			case NCKEY_UP:    mask = 0x080; break;
-			case NCKEY_DOWN:  mask = 0x100; break;
-			case NCKEY_LEFT:  mask = 0x200; break;
-			case NCKEY_RIGHT: mask = 0x400; break;
+	return static_cast<bool>(file);
+}
 
-			default: return; // Ignore unsupported keys
+bool write_text_scene(const Scene& scene, const Camera& camera, const std::string& path) {
+	std::ofstream file{ path };
+	file.precision(9); // Enough digits to read back the same floats
+
+	const auto vec = [&file](const Vec3& v) -> std::ofstream& {
+		file << "  " << v.x << " " << v.y << " " << v.z;
+		return file;
+	};
+	const auto color = [&file](const Pixel& c) -> std::ofstream& {
+		file << "  " << static_cast<int>(c.r) << " " << static_cast<int>(c.g) << " " << static_cast<int>(c.b);
+		return file;
+	};
+
+	file << "camera";
+	vec(camera.position) << "  " << camera.yawDegrees << " " << camera.pitchDegrees << "\n";
+	for (const Light& light : scene.lights) {
+		file << "light";
+		vec(light.direction);
+		color(light.color) << "\n";
+	}
+
+	// Write the entry of an object (false for objects scene files can't hold)
+	const auto entry = [&](const Object& object) {
+		switch (record_type(object)) {
+			case SceneRecordType::Plane: {
+				const auto& plane = static_cast<const Plane&>(object);
+				file << "plane";
+				vec(plane.center);
+				vec(plane.normal);
+				color(plane.color) << "\n";
+				break;
+			}
+			case SceneRecordType::Checkerboard: {
+				const auto& plane = static_cast<const CheckerboardPlane&>(object);
+				file << "checkerboard";
+				vec(plane.center);
+				vec(plane.normal) << "  " << plane.cellSize;
+				color(plane.lightColor);
+				color(plane.darkColor) << "\n";
+				break;
+			}
+			case SceneRecordType::Box: {
+				const auto& box = static_cast<const Box&>(object);
+				file << "box";
+				vec(box.center);
+				vec(box.u * (box.hu * 2.0f));
+				vec(box.v * (box.hv * 2.0f));
+				vec(box.w * (box.hw * 2.0f));
+				color(box.color) << "\n";
+				break;
+			}
+			case SceneRecordType::Sphere: {
+				const auto& sphere = static_cast<const Sphere&>(object);
+				file << "sphere";
+				vec(sphere.center) << "  " << sphere.radius;
+				color(sphere.color) << "\n";
+				break;
+			}
+			case SceneRecordType::Mesh: {
+				const auto& mesh = static_cast<const Mesh&>(object);
+				file << "mesh  " << mesh.path;
+				color(mesh.color) << "\n";
+				break;
+			}
+			case SceneRecordType::Instance: // Written by the loop below, which defines the geometry first
+			case SceneRecordType::Material:
+			case SceneRecordType::None:
+				return false;
+		}
+		if (object.reflectivity != 0.0f || object.roughness != 0.0f) file << "material  " << object.reflectivity << " " << object.roughness << "\n";
+		return true;
+	};
+
+	vector<std::pair<const Object*, std::string>> geometries; // Defined so far, with their names
+	for (size_t i = 0; i < scene.objects.size(); ++i) {
+		const Object& object = *scene.objects[i];
+		const auto* instance = dynamic_cast<const Instance*>(&object);
+		if (!instance) {
+			if (!entry(object)) {
+				std::cerr << "Scene files can't hold object " << i << "\n";
+				return false;
+			}
+			continue;
 		}
 
-		packed |= mask;
+		const Object* geometry = instance->geometry.get();
+		auto defined = std::find_if(geometries.begin(), geometries.end(), [&](const auto& g) { return g.first == geometry; });
+		if (defined == geometries.end()) {
+			// Instances of different geometries can carry the same name
+			std::string name = instance->name.empty() ? "geometry" : instance->name;
+			const auto taken = [&](const std::string& n) { return std::any_of(geometries.begin(), geometries.end(), [&](const auto& g) { return g.second == n; }); };
+			if (taken(name)) {
+				size_t suffix = 2;
+				while (taken(name + std::to_string(suffix))) ++suffix;
+				name += std::to_string(suffix);
+			}
+
+			file << "define  " << name << "  ";
+			if (!entry(*geometry)) {
+				std::cerr << "Scene files can't hold the geometry of object " << i << "\n";
+				return false;
+			}
+			defined = geometries.emplace(geometries.end(), geometry, std::move(name));
+		}
+
+		file << "instance  " << defined->second;
+		vec(instance->translation);
+		vec(instance->rotation);
+		vec(instance->scale) << "\n";
+		if (object.reflectivity != geometry->reflectivity || object.roughness != geometry->roughness) {
+			file << "material  " << object.reflectivity << " " << object.roughness << "\n";
+		}
 	}
 
-	// Functions to check if a key is pressed
-	bool q() const {
-		return packed & 0x001;
+	return static_cast<bool>(file);
+}
+
+// Write the scene as binary when the path ends in .bscene, as text otherwise
+bool write_scene_file(const Scene& scene, const Camera& camera, const std::string& path) {
+	const std::string binaryExtension = ".bscene";
+	const bool binary = path.size() >= binaryExtension.size() && path.compare(path.size() - binaryExtension.size(), binaryExtension.size(), binaryExtension) == 0;
+	return binary ? write_binary_scene(scene, camera, path) : write_text_scene(scene, camera, path);
+}
+
+// Placement that centers bounded geometry at position with the given largest extent
+// Mesh files are usually y-up while the scene has y pointing down, so the geometry is also turned upright.
+unique_ptr<Instance> fit_instance(std::shared_ptr<const Object> geometry, const std::string& name, const float size, const Vec3& rotation, const Vec3& position) {
+	AABB bounds;
+	geometry->getBounds(bounds);
+	const Vec3 extent = bounds.upper - bounds.lower;
+	const float fit = size / max(max(extent.x, extent.y), max(extent.z, 1e-6f));
+	const Vec3 scale{ fit, -fit, fit };
+	const Vec3 offset = Transform::compose(scale, rotation, Vec3{}).vector(bounds.centroid());
+	return make_unique<Instance>(std::move(geometry), name, scale, rotation, position - offset);
+}
+
+// Fill a scene with a ground plane and the mesh of a file, scaled to about the size of the demo scene
+// The mesh is placed by an instance, so saved scenes reference the file as it is.
+bool create_mesh_scene(Scene& scene, const std::string& path) {
+	std::shared_ptr<Mesh> mesh = load_mesh_file(path, Pixel{ 220, 220, 220 });
+	if (!mesh) return false;
+
+	scene.objects.emplace_back(make_unique<Plane>(Vec3{ 0, 25, 0 }, Vec3{ 0, 1, 0 }, Pixel{ 230, 230, 230 })); // Light gray ground plane
+	scene.objects.emplace_back(fit_instance(std::move(mesh), "mesh", 50.0f, Vec3{}, Vec3{}));
+	scene.lights = {
+		Light{Vec3{5, -10, 1}, Pixel{182, 34, 228}}, // Back top right (magenta light)
+		Light{Vec3{-10, 3, -1}, Pixel{24, 236, 238 }}, // Front bottom left (cyan light)
+		Light{Vec3{1, 4, -1}, Pixel{100, 100, 100 }}, // Front bottom right (dim white)
+	};
+	return true;
+}
+
+// Fill a benchmark scene with a ground plane and randomly placed, turned, and sized copies of one bounded geometry
+// (the field of create_sphere_field, made of instances)
+void create_instance_field(Scene& scene, const size_t count, const std::shared_ptr<const Object>& geometry, const std::string& name) {
+	scene.objects.emplace_back(make_unique<Plane>(Vec3{ 0, 25, 0 }, Vec3{ 0, 1, 0 }, Pixel{ 230, 230, 230 })); // Light gray ground plane
+
+	std::mt19937 rng{ 1234 }; // Fixed seed so runs are comparable
+	std::uniform_real_distribution<float> x{ -200.0f, 200.0f }, y{ -100.0f, 20.0f }, z{ 0.0f, 800.0f }, size{ 2.0f, 8.0f }, angle{ 0.0f, 360.0f };
+	for (size_t i = 0; i < count; ++i) {
+		const Vec3 position{ x(rng), y(rng), z(rng) };
+		const float s = size(rng);
+		const Vec3 rotation{ angle(rng), angle(rng), angle(rng) };
+		scene.objects.emplace_back(fit_instance(geometry, name, s, rotation, position));
 	}
 
-	bool w() const {
-		return packed & 0x002;
+	scene.lights = {
+		Light{Vec3{5, -10, 1}, Pixel{182, 34, 228}}, // Back top right (magenta light)
+		Light{Vec3{-10, 3, -1}, Pixel{24, 236, 238 }}, // Front bottom left (cyan light)
+		Light{Vec3{1, 4, -1}, Pixel{100, 100, 100 }}, // Front bottom right (dim white)
+	};
+}
+
+// Write a bumpy sphere of about the given number of triangles as a mesh benchmark (binary PLY for .ply, OBJ otherwise)
+bool generate_mesh_file(const std::string& path, const size_t triangleCount) {
+	// A latitude-longitude grid with twice as many segments as rings has 4 * rings^2 triangles
+	const size_t rings = max<size_t>(2, static_cast<size_t>(std::sqrt(triangleCount / 4.0) + 0.5));
+	const size_t segments = 2 * rings;
+	constexpr float PI = 3.14159265f;
+
+	vector<Vec3> vertices;
+	vertices.reserve((rings + 1) * (segments + 1));
+	for (size_t ring = 0; ring <= rings; ++ring) {
+		const float theta = PI * ring / rings;
+		for (size_t segment = 0; segment <= segments; ++segment) {
+			const float phi = 2.0f * PI * segment / segments;
+			const float radius = 25.0f * (1.0f + 0.06f * std::sin(7.0f * theta) * std::sin(9.0f * phi));
+			vertices.emplace_back(radius * std::sin(theta) * std::cos(phi), radius * std::cos(theta), radius * std::sin(theta) * std::sin(phi));
+		}
 	}
-	bool a() const {
-		return packed & 0x004;
+
+	vector<uint32_t> indices;
+	indices.reserve(rings * segments * 6);
+	for (size_t ring = 0; ring < rings; ++ring) {
+		for (size_t segment = 0; segment < segments; ++segment) {
+			const uint32_t a = static_cast<uint32_t>(ring * (segments + 1) + segment), b = a + 1;
+			const uint32_t c = a + static_cast<uint32_t>(segments + 1), d = c + 1;
+			indices.insert(indices.end(), { a, c, b, b, c, d });
+		}
 	}
-	bool s() const {
-		return packed & 0x008;
+
+	const std::string plyExtension = ".ply";
+	const bool ply = path.size() >= plyExtension.size() && path.compare(path.size() - plyExtension.size(), plyExtension.size(), plyExtension) == 0;
+	std::ofstream file{ path, std::ios::binary };
+	if (ply) {
+		file << "ply\nformat binary_little_endian 1.0\ncomment bumpy sphere benchmark mesh\n"
+			<< "element vertex " << vertices.size() << "\nproperty float x\nproperty float y\nproperty float z\n"
+			<< "element face " << indices.size() / 3 << "\nproperty list uchar uint vertex_indices\nend_header\n";
+		static_assert(sizeof(Vec3) == 3 * sizeof(float), "Vertices are written as x, y, z floats");
+		file.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(Vec3));
+		for (size_t i = 0; i < indices.size(); i += 3) {
+			const uint8_t count = 3;
+			file.write(reinterpret_cast<const char*>(&count), 1);
+			file.write(reinterpret_cast<const char*>(&indices[i]), 3 * sizeof(uint32_t));
+		}
 	}
-	bool d() const {
-		return packed & 0x010;
+	else {
+		file.precision(7);
+		file << "# Bumpy sphere benchmark mesh\n";
+		for (const Vec3& v : vertices) file << "v " << v.x << " " << v.y << " " << v.z << "\n";
+		for (size_t i = 0; i < indices.size(); i += 3) file << "f " << indices[i] + 1 << " " << indices[i + 1] + 1 << " " << indices[i + 2] + 1 << "\n";
 	}
 
-	bool space() const {
-		return packed & 0x020;
+	if (!file) return false;
+	std::cerr << "Wrote " << vertices.size() << " vertices and " << indices.size() / 3 << " triangles to " << path << "\n";
+	return true;
+}
+
+// Command line options
+struct Options {
+	size_t threads = std::thread::hardware_concurrency(); // Render threads (1 renders on the main thread only)
+	AccelMode accel = AccelMode::BVH;
+	bool packets = false;
+	size_t spheres = 0; // Replace the demo scene with this many random spheres (benchmark scene)
+	std::string scenePath; // Load the scene (and camera) from a scene file instead
+	std::string saveScenePath; // Write the scene to a scene file and exit (converts between formats)
+	std::string meshPath; // Render this mesh file (OBJ or PLY) on a ground plane instead of the demo scene
+	std::string generateMeshPath; // Write a generated benchmark mesh and exit
+	size_t generateTriangles = 0;
+	size_t instances = 0; // Replace the scene with this many copies of one shared geometry (the mesh, or a box)
+
+	// Headless benchmark mode (no terminal needed)
+	bool headless = false;
+	size_t frames = 100;
+	u_int cols = 160, rows = 48; // Terminal size to emulate
+	std::string dumpPath; // Write the last frame as a PPM image (for diffing output)
+
+	Backend backend = Backend::Cells;
+	bool pipelined = false; // Present on a separate thread while the next frame renders
+
+	double targetFps = 30.0; // 0 = uncapped
+	ScalePolicy scalePolicy = ScalePolicy::Off;
+	float renderScale = 1.0f; // Internal render resolution (upper bound when scaling adapts)
+	UpscaleFilter upscaleFilter = UpscaleFilter::Bilinear;
+
+	TemporalReuse reuse = TemporalReuse::Off;
+	ShadowMode shadows = ShadowMode::Off;
+	size_t reflections = 0; // Reflection depth (0 = off)
+	size_t samples = 1; // Anti-aliasing samples per pixel accumulated while the view is still (1 = off)
+	size_t edgeRays = 0; // Extra rays per frame for anti-aliasing edges (0 = off)
+	bool animateObject = false; // Move the first sphere (or in headless mode, sphere or instance) every frame
+	size_t moving = 0; // Headless: move this many spheres or instances every frame (animated scene benchmark)
+	float rebuildThreshold = 1.5f; // SAH cost growth after which moved objects rebuild the BVH instead of refitting it
+	bool animateCamera = false; // Headless: turn and move the camera a little every frame
+	bool animateLights = false; // Headless: turn the lights a little every frame
+	bool deferred = false; // Shade in a separate pass over a G-buffer
+};
+
+void print_usage(const char* program) {
+	std::cerr << "Usage: " << program << " [options]\n"
+		<< "  --threads N    Number of render threads (default: all cores, 1 = single-threaded, at most 4x the cores)\n"
+		<< "  --accel MODE   Closest hit search: bvh (default), packed (SIMD batches), or linear\n"
+		<< "  --packets      Trace primary rays in 8x8 packets with frustum culling (bvh only)\n"
+		<< "  --shadows MODE off (default), on (any-hit shadow rays), or closest (closest-hit shadow rays, for comparison)\n"
+		<< "  --reflections N  Follow up to N reflections off reflective materials (default: 0 = off, at most 16)\n"
+		<< "  --spheres N    Replace the demo scene with N random spheres (BVH benchmark scene)\n"
+		<< "  --scene FILE   Load the scene from a text (.scene) or binary (.bscene) scene file\n"
+		<< "  --mesh FILE    Replace the demo scene with a triangle mesh (OBJ or PLY), fitted to the view\n"
+		<< "  --instances N  Replace the scene with N randomly placed copies of one shared geometry (the --mesh file, or\n"
+		<< "                 a box), each an instance with its own transform\n"
+		<< "  --generate-mesh N FILE  Write a bumpy sphere of about N triangles (binary PLY for .ply, OBJ otherwise) and exit\n"
+		<< "  --save-scene FILE  Write the scene to FILE (binary if it ends in .bscene, text otherwise) and exit\n"
+		<< "  --backend B    Output: cells (default), half, quad, sextant, or pixel (sixel/kitty)\n"
+		<< "  --present MODE sync (default, at most one frame of input latency) or pipelined (present on a second thread)\n"
+		<< "  --fps N        Target frame rate (default: 30, 0 = uncapped)\n"
+		<< "  --scale F      Internal render resolution as a fraction of the output (default: 1)\n"
+		<< "  --scale-policy off (default), step (lower the render scale while frames run over budget),\n"
+		<< "                 or hold (steer the render scale to keep frames within the --fps budget)\n"
+		<< "  --upscale F    Filter for scaled renders: nearest, bilinear (default), or edge (edge-aware)\n"
+		<< "  --aa N         Progressive anti-aliasing: accumulate up to N jittered samples per pixel over the frames\n"
+		<< "                 the view holds still (default: 1 = off, one sample per pixel while moving)\n"
+		<< "  --edge-aa N    Adaptive anti-aliasing: spend up to N extra rays per frame on pixels at object, normal, or\n"
+		<< "                 color edges, most contrasted first (default: 0 = off)\n"
+		<< "  --reuse MODE   Reuse pixels of the previous frame: off (default), static (only pixels changed objects can't\n"
+		<< "                 affect, exact), or reproject (also follow small camera moves, approximate)\n"
+		<< "  --shading MODE forward (default, shade each pixel as it is traced) or deferred (trace into a G-buffer, then\n"
+		<< "                 light it in a vectorized pass, and only light it again while just the lights change;\n"
+		<< "                 forward shading is used with --reflections or --reuse)\n"
+		<< "  --animate WHAT Headless: move object (the first sphere or instance), camera, both, or lights every frame\n"
+		<< "                 (interactive: object drifts the first sphere)\n"
+		<< "  --moving N     Headless: move N spheres or instances spread over the scene every frame\n"
+		<< "  --rebuild-threshold F  Rebuild the BVH once moved objects made it F times as costly to traverse (SAH) as\n"
+		<< "                 when built, refit it before that (default: 1.5, 0 = rebuild after every move)\n"
+		<< "  --headless     Render without a terminal and print frame timings as JSON\n"
+		<< "  --frames N     Frames to render in headless mode (default: 100)\n"
+		<< "  --size CxR     Terminal size in cells to render in headless mode (default: 160x48)\n"
+		<< "  --dump FILE    Write the last headless frame to FILE as a PPM image\n";
+}
+
+// Parse the command line into options (returns false on bad input)
+bool parse_options(const int argc, char* argv[], Options& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--threads" && hasValue) {
+			const std::string count = argv[++i];
+			if (count.find('-') != std::string::npos) return false; // stoul would wrap negative counts to huge ones
+			options.threads = std::stoul(count);
+		}
+		else if (arg == "--accel" && hasValue) {
+			const std::string mode = argv[++i];
+			if (mode == "bvh") options.accel = AccelMode::BVH;
+			else if (mode == "packed") options.accel = AccelMode::Packed;
+			else if (mode == "linear") options.accel = AccelMode::Linear;
+			else return false;
+		}
+		else if (arg == "--shadows" && hasValue) {
+			const std::string mode = argv[++i];
+			if (mode == "off") options.shadows = ShadowMode::Off;
+			else if (mode == "on") options.shadows = ShadowMode::AnyHit;
+			else if (mode == "closest") options.shadows = ShadowMode::ClosestHit;
+			else return false;
+		}
+		else if (arg == "--reflections" && hasValue) {
+			options.reflections = std::stoul(argv[++i]);
+			if (options.reflections > MAX_BOUNCES) return false;
+		}
+		else if (arg == "--aa" && hasValue) {
+			options.samples = std::stoul(argv[++i]);
+			if (options.samples == 0) return false;
+		}
+		else if (arg == "--edge-aa" && hasValue) {
+			options.edgeRays = std::stoul(argv[++i]);
+		}
+		else if (arg == "--packets") {
+			options.packets = true;
+		}
+		else if (arg == "--spheres" && hasValue) {
+			options.spheres = std::stoul(argv[++i]);
+		}
+		else if (arg == "--mesh" && hasValue) {
+			options.meshPath = argv[++i];
+		}
+		else if (arg == "--moving" && hasValue) {
+			options.moving = std::stoul(argv[++i]);
+		}
+		else if (arg == "--rebuild-threshold" && hasValue) {
+			options.rebuildThreshold = std::stof(argv[++i]);
+		}
+		else if (arg == "--instances" && hasValue) {
+			options.instances = std::stoul(argv[++i]);
+		}
+		else if (arg == "--generate-mesh" && i + 2 < argc) {
+			options.generateTriangles = std::stoul(argv[++i]);
+			options.generateMeshPath = argv[++i];
+		}
+		else if (arg == "--scene" && hasValue) {
+			options.scenePath = argv[++i];
+		}
+		else if (arg == "--save-scene" && hasValue) {
+			options.saveScenePath = argv[++i];
+		}
+		else if (arg == "--headless") {
+			options.headless = true;
+		}
+		else if (arg == "--frames" && hasValue) {
+			options.frames = std::stoul(argv[++i]);
+		}
+		else if (arg == "--size" && hasValue) {
+			const std::string size = argv[++i];
+			const size_t split = size.find('x');
+			if (split == std::string::npos) return false;
+			options.cols = std::stoul(size.substr(0, split));
+			options.rows = std::stoul(size.substr(split + 1));
+		}
+		else if (arg == "--backend" && hasValue) {
+			const std::string name = argv[++i];
+			if (name == "cells") options.backend = Backend::Cells;
+			else if (name == "half") options.backend = Backend::HalfBlock;
+			else if (name == "quad") options.backend = Backend::Quadrant;
+			else if (name == "sextant") options.backend = Backend::Sextant;
+			else if (name == "pixel") options.backend = Backend::Bitmap;
+			else return false;
+		}
+		else if (arg == "--present" && hasValue) {
+			const std::string mode = argv[++i];
+			if (mode == "sync") options.pipelined = false;
+			else if (mode == "pipelined") options.pipelined = true;
+			else return false;
+		}
+		else if (arg == "--fps" && hasValue) {
+			options.targetFps = std::stod(argv[++i]);
+		}
+		else if (arg == "--scale" && hasValue) {
+			options.renderScale = std::stof(argv[++i]);
+		}
+		else if (arg == "--scale-policy" && hasValue) {
+			const std::string policy = argv[++i];
+			if (policy == "off") options.scalePolicy = ScalePolicy::Off;
+			else if (policy == "step") options.scalePolicy = ScalePolicy::Step;
+			else if (policy == "hold") options.scalePolicy = ScalePolicy::Hold;
+			else return false;
+		}
+		else if (arg == "--upscale" && hasValue) {
+			const std::string filter = argv[++i];
+			if (filter == "nearest") options.upscaleFilter = UpscaleFilter::Nearest;
+			else if (filter == "bilinear") options.upscaleFilter = UpscaleFilter::Bilinear;
+			else if (filter == "edge") options.upscaleFilter = UpscaleFilter::EdgeAware;
+			else return false;
+		}
+		else if (arg == "--reuse" && hasValue) {
+			const std::string mode = argv[++i];
+			if (mode == "off") options.reuse = TemporalReuse::Off;
+			else if (mode == "static") options.reuse = TemporalReuse::Static;
+			else if (mode == "reproject") options.reuse = TemporalReuse::Reproject;
+			else return false;
+		}
+		else if (arg == "--animate" && hasValue) {
+			const std::string what = argv[++i];
+			if (what == "object") options.animateObject = true;
+			else if (what == "camera") options.animateCamera = true;
+			else if (what == "both") options.animateObject = options.animateCamera = true;
+			else if (what == "lights") options.animateLights = true;
+			else return false;
+		}
+		else if (arg == "--shading" && hasValue) {
+			const std::string mode = argv[++i];
+			if (mode == "forward") options.deferred = false;
+			else if (mode == "deferred") options.deferred = true;
+			else return false;
+		}
+		else if (arg == "--dump" && hasValue) {
+			options.dumpPath = argv[++i];
+		}
+		else {
+			return false;
+		}
 	}
-	bool x() const {
-		return packed & 0x040;
+
+	if (options.threads == 0) options.threads = 1; // hardware_concurrency() can return 0
+	const size_t maxThreads = 4 * max(std::thread::hardware_concurrency(), 1u);
+	return options.threads <= maxThreads && options.frames > 0 && options.cols >= 2 && options.rows >= 1
+		&& options.targetFps >= 0.0 && options.renderScale > 0.0f && options.renderScale <= 1.0f;
+}
+
+// Set up the display for a backend (nc may be null in headless mode, which assumes 8x16 pixel cells for bitmaps)
+void apply_backend(Display3D& display, Backend backend, notcurses* nc, const u_int cols, const u_int rows) {
+	// Bitmap graphics need terminal support, fall back to half blocks without it
+	if (backend == Backend::Bitmap && nc && notcurses_check_pixel_support(nc) <= NCPIXEL_NONE) backend = Backend::HalfBlock;
+
+	switch (backend) {
+		case Backend::Cells:     display.setBackend(backend, 1, 1, 0.5f); break; // Cells are twice as tall as wide
+		case Backend::HalfBlock: display.setBackend(backend, 1, 2, 1.0f); break;
+		case Backend::Quadrant:  display.setBackend(backend, 2, 2, 0.5f); break;
+		case Backend::Sextant:   display.setBackend(backend, 2, 3, 0.75f); break;
+		case Backend::Bitmap: {
+			u_int cellPixelRows = 16, cellPixelCols = 8;
+			if (nc) ncplane_pixel_geom(notcurses_stdplane(nc), nullptr, nullptr, &cellPixelRows, &cellPixelCols, nullptr, nullptr);
+			display.setBackend(backend, max(cellPixelCols, 1u), max(cellPixelRows, 1u), 1.0f);
+			break;
+		}
 	}
 
-	bool up() const {
-		return packed & 0x080;
+	display.resize(cols / 2, rows);
+}
+
+// Write the image as a binary PPM
+bool write_ppm(const Display3D& display, const std::string& path) {
+	std::ofstream file{ path, std::ios::binary };
+	file << "P6\n" << display.getNumCols() << " " << display.getNumRows() << "\n255\n";
+	for (const Pixel& px : display.flattenedPixels) {
+		file.put(static_cast<char>(px.r)).put(static_cast<char>(px.g)).put(static_cast<char>(px.b));
 	}
-	bool down() const {
-		return packed & 0x100;
+	return static_cast<bool>(file);
+}
+
+const char* accel_name(const AccelMode accel) {
+	switch (accel) {
+		case AccelMode::Linear: return "linear";
+		case AccelMode::BVH:    return "bvh";
+		case AccelMode::Packed: return "packed";
 	}
-	bool left() const {
-		return packed & 0x200;
+	return "unknown";
+}
+
+const char* shadow_name(const ShadowMode shadows) {
+	switch (shadows) {
+		case ShadowMode::Off:        return "off";
+		case ShadowMode::AnyHit:     return "on";
+		case ShadowMode::ClosestHit: return "closest";
 	}
-	bool right() const {
-		return packed & 0x400;
+	return "unknown";
+}
+
+const char* reuse_name(const TemporalReuse reuse) {
+	switch (reuse) {
+		case TemporalReuse::Off:       return "off";
+		case TemporalReuse::Static:    return "static";
+		case TemporalReuse::Reproject: return "reproject";
 	}
-};
+	return "unknown";
+}
+
+// Create or load the scene selected by the options (scene files may also place the camera)
+bool read_scene(const Options& options, Scene& scene, Camera& camera) {
+	if (!options.scenePath.empty()) return load_scene_file(options.scenePath, scene, camera);
+	if (options.instances > 0) {
+		std::shared_ptr<const Object> geometry;
+		if (!options.meshPath.empty()) geometry = load_mesh_file(options.meshPath, Pixel{ 220, 220, 220 });
+		else geometry = std::make_shared<Box>(Vec3{}, Vec3{ 1, 0, 0 }, Vec3{ 0, 1, 0 }, Vec3{ 0, 0, 1 }, Pixel{ 230, 180, 120 });
+		if (!geometry) return false;
+		create_instance_field(scene, options.instances, geometry, options.meshPath.empty() ? "box" : "mesh");
+		return true;
+	}
+	if (!options.meshPath.empty()) return create_mesh_scene(scene, options.meshPath);
+
+	if (options.spheres > 0) create_sphere_field(scene, options.spheres);
+	else create_scene(scene);
+	return true;
+}
+
+// Create the scene selected by the options and build its acceleration structures
+bool load_scene(const Options& options, Scene& scene, Camera& camera) {
+	if (!read_scene(options, scene, camera)) return false;
+
+	scene.accel = options.accel;
+	scene.shadows = options.shadows;
+	scene.maxBounces = options.reflections;
+	scene.rebuildThreshold = options.rebuildThreshold;
+	scene.build();
+	return true;
+}
+
+// Write the selected scene to a scene file, reporting how long reading it took
+int save_scene(const Options& options) {
+	Scene scene;
+	Camera camera{ Vec3{ 0, 0, -60 }, 0.0f, 0.0f };
+
+	const auto start = std::chrono::steady_clock::now();
+	if (!read_scene(options, scene, camera)) return 1;
+	const double readMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	if (!write_scene_file(scene, camera, options.saveScenePath)) {
+		std::cerr << "Failed to write " << options.saveScenePath << "\n";
+		return 1;
+	}
+
+	std::cerr << "Wrote " << scene.objects.size() << " objects and " << scene.lights.size() << " lights to " << options.saveScenePath
+		<< " (read in " << readMs << " ms)\n";
+	return 0;
+}
+
+// Render a fixed number of frames of the selected scene without a terminal and print timing stats as JSON
+int run_headless(const Options& options) {
+	Display3D display{ options.cols / 2, options.rows, nullptr };
+	apply_backend(display, options.backend, nullptr, options.cols, options.rows);
+	WorkerPool pool{ options.threads };
+	display.pool = &pool;
+	display.packets = options.packets;
+	display.renderScale = options.renderScale;
+	display.upscaleFilter = options.upscaleFilter;
+	display.reuse = options.reuse;
+	display.maxSamples = options.samples;
+	display.edgeSampler.budget = options.edgeRays;
+	display.deferred = options.deferred;
+
+	// Adaptive scaling runs the controller on the measured render times (headless frames don't sleep)
+	FramePacer pacer{ options.targetFps, options.scalePolicy, options.renderScale };
+
+	Camera camera{ Vec3{ 0, 0, -60 }, 0.0f, 0.0f };
+	Scene scene;
+	const auto loadStart = std::chrono::steady_clock::now();
+	if (!read_scene(options, scene, camera)) return 1;
+	const auto buildStart = std::chrono::steady_clock::now();
+	scene.accel = options.accel;
+	scene.shadows = options.shadows;
+	scene.maxBounces = options.reflections;
+	scene.rebuildThreshold = options.rebuildThreshold;
+	scene.build();
+	const auto buildEnd = std::chrono::steady_clock::now();
+	const double loadMs = std::chrono::duration<double, std::milli>(buildStart - loadStart).count();
+	const double buildMs = std::chrono::duration<double, std::milli>(buildEnd - buildStart).count();
+
+	// Spread the moving objects evenly over the spheres and instances of the scene, each drifting its own way
+	vector<size_t> movable;
+	for (size_t i = 0; i < scene.objects.size(); ++i) {
+		if (dynamic_cast<Sphere*>(scene.objects[i].get()) || dynamic_cast<Instance*>(scene.objects[i].get())) movable.push_back(i);
+	}
+	const size_t movingCount = min(movable.size(), options.moving > 0 ? options.moving : (options.animateObject ? 1 : 0));
+	vector<std::pair<size_t, Vec3>> animated; // Object index and velocity per frame
+	std::mt19937 rng{ 42 };
+	std::uniform_real_distribution<float> speed{ -0.2f, 0.2f };
+	for (size_t i = 0; i < movingCount; ++i) animated.emplace_back(movable[i * movable.size() / movingCount], Vec3{ speed(rng), speed(rng), speed(rng) });
+
+	vector<double> frameMs;
+	frameMs.reserve(options.frames);
+	double reusedFraction = 0.0;
+	double totalRays = 0.0; // Primary and reflection rays over all frames
+	double totalPixels = 0.0; // Rendered pixels over all frames (the render scale can change from frame to frame)
+	double totalEdgePixels = 0.0, totalSampledEdges = 0.0; // Edge pixels found, and those that got extra rays
+	vector<double> updateMs; // Time spent updating the acceleration structures after the objects moved
+	const size_t initialBuilds = scene.builds;
+	for (size_t frame = 0; frame < options.frames; ++frame) {
+		if (!animated.empty() && frame > 0) {
+			for (const auto& [index, velocity] : animated) {
+				if (auto* instance = dynamic_cast<Instance*>(scene.objects[index].get())) {
+					instance->translation = instance->translation + velocity;
+					instance->rotation.y += 1.0f;
+					instance->update();
+				}
+				else {
+					auto* sphere = static_cast<Sphere*>(scene.objects[index].get());
+					sphere->center = sphere->center + velocity;
+				}
+				scene.markMoved(index);
+			}
+
+			const auto updateStart = std::chrono::steady_clock::now();
+			scene.update();
+			updateMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - updateStart).count());
+		}
+		if (options.animateCamera && frame > 0) {
+			camera.yawDegrees += 0.25f;
+			camera.position.z += 0.1f;
+			camera.wrapAndClampAngles();
+		}
+		if (options.animateLights && frame > 0) {
+			// Turn the lights about the vertical axis
+			const float c = cos(degToRad(2.0f)), s = sin(degToRad(2.0f));
+			for (Light& light : scene.lights) {
+				const Vec3 d = light.direction;
+				light.direction = Vec3{ c * d.x + s * d.z, d.y, c * d.z - s * d.x }.norm();
+			}
+			scene.markLightsChanged();
+		}
+
+		display.renderScale = pacer.scale;
+		pacer.beginFrame();
+		const auto start = std::chrono::steady_clock::now();
+		display.clear();
+		display.render_scene_to_image(camera, scene);
+		const auto end = std::chrono::steady_clock::now();
+		pacer.markRendered();
+		pacer.markPresented();
+
+		frameMs.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+		if (display.reuse != TemporalReuse::Off) reusedFraction += static_cast<double>(display.history.reusedPixels) / (display.getRenderCols() * display.getRenderRows());
+		totalRays += static_cast<double>(display.primaryRays + display.secondaryRays);
+		totalPixels += static_cast<double>(display.getRenderCols() * display.getRenderRows());
+		totalEdgePixels += display.edgeSampler.edgePixels;
+		totalSampledEdges += display.edgeSampler.sampledPixels;
+	}
+
+	if (!options.dumpPath.empty() && !write_ppm(display, options.dumpPath)) {
+		std::cerr << "Failed to write " << options.dumpPath << "\n";
+		return 1;
+	}
+
+	double totalMs = 0.0;
+	for (const double ms : frameMs) totalMs += ms;
+	double totalUpdateMs = 0.0, maxUpdateMs = 0.0;
+	for (const double ms : updateMs) {
+		totalUpdateMs += ms;
+		maxUpdateMs = max(maxUpdateMs, ms);
+	}
+
+	vector<double> sorted = frameMs;
+	std::sort(sorted.begin(), sorted.end());
+	// Nearest-rank percentile
+	const auto percentile = [&sorted](const double p) {
+		const size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[min(max<size_t>(rank, 1), sorted.size()) - 1];
+	};
+
+	std::cout << "{\n"
+		<< "  \"frames\": " << frameMs.size() << ",\n"
+		<< "  \"width\": " << display.getNumCols() << ",\n"
+		<< "  \"height\": " << display.getNumRows() << ",\n"
+		<< "  \"render_scale\": " << display.renderScale << ",\n"
+		<< "  \"threads\": " << pool.getNumThreads() << ",\n"
+		<< "  \"objects\": " << scene.objects.size() << ",\n"
+		<< "  \"accel\": \"" << accel_name(scene.accel) << "\",\n"
+		<< "  \"packets\": " << (display.packets ? "true" : "false") << ",\n"
+		<< "  \"shadows\": \"" << shadow_name(scene.shadows) << "\",\n"
+		<< "  \"reflections\": " << scene.maxBounces << ",\n"
+		<< "  \"shading\": \"" << (display.deferred ? "deferred" : "forward") << "\",\n"
+		<< "  \"relit_frames\": " << display.gbuffer.relitFrames << ",\n"
+		<< "  \"load_ms\": " << loadMs << ",\n"
+		<< "  \"build_ms\": " << buildMs << ",\n"
+		<< "  \"moving\": { \"objects\": " << animated.size()
+		<< ", \"update_ms\": " << totalUpdateMs / max<size_t>(updateMs.size(), 1) << ", \"max_update_ms\": " << maxUpdateMs
+		<< ", \"rebuilds\": " << scene.builds - initialBuilds << ", \"bvh_degradation\": " << scene.bvh.degradation() << " },\n"
+		<< "  \"frame_ms\": { \"min\": " << sorted.front()
+		<< ", \"avg\": " << totalMs / frameMs.size()
+		<< ", \"p50\": " << percentile(0.50)
+		<< ", \"p99\": " << percentile(0.99)
+		<< ", \"max\": " << sorted.back() << " },\n"
+		<< "  \"rays_per_second\": " << totalRays / (totalMs / 1000.0) << ",\n"
+		<< "  \"pixels_per_second\": " << totalPixels / (totalMs / 1000.0) << ",\n"
+		<< "  \"rays_per_pixel\": " << totalRays / totalPixels << ",\n"
+		<< "  \"edge_aa\": { \"budget\": " << display.edgeSampler.budget << ", \"edge_pixels\": " << totalEdgePixels / frameMs.size()
+		<< ", \"sampled_pixels\": " << totalSampledEdges / frameMs.size() << ", \"extra_rays\": " << totalSampledEdges * EdgeSampler::SAMPLES / frameMs.size() << " },\n"
+		<< "  \"aa_samples\": " << (display.maxSamples > 1 ? display.accumulator.samples : 1) << ",\n"
+		<< "  \"reuse\": \"" << reuse_name(display.reuse) << "\",\n"
+		<< "  \"reused_pixels\": " << reusedFraction / frameMs.size() << "\n"
+		<< "}\n";
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+	try {
+		if (!parse_options(argc, argv, options)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	catch (const std::exception&) { // Number conversion failed
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (!options.generateMeshPath.empty()) return generate_mesh_file(options.generateMeshPath, options.generateTriangles) ? 0 : 1;
+	if (!options.saveScenePath.empty()) return save_scene(options);
+	if (options.headless) return run_headless(options);
+
+	//
+	// Camera and object creation
+	//
+
+	// Camera position (want to have it behind the image plane)
+	Camera camera{ Vec3{ 0, 0, -60 }, 0.0f, 0.0f }; // Straight camera
+
+	// Combine all objects and lights into a scene
+	Scene scene;
+	if (!load_scene(options, scene, camera)) return 1;
 
-int main() {
 	//
 	// Terminal setup and notcurses initialization
 	//
@@ -623,34 +5057,38 @@ int main() {
 	// Auto-detect terminal size (zoom terminal out really far for lots of pixels)
 	u_int rows, cols;
 	notcurses_stddim_yx(nc, &rows, &cols);
-	Display3D display{ cols / 2, rows, stdplane };
-
-	//
-	// Camera and object creation
-	//
-
-	// Camera position (want to have it behind the image plane)
-	Camera camera{ Vec3{ 0, 0, -60 }, 0.0f, 0.0f }; // Straight camera
-
-	// Combine all objects into a vector of Object pointers
-	vector<unique_ptr<Object>> objects;
-
-	objects.emplace_back(make_unique<Plane>(Vec3{ 0, 25, 0 }, Vec3{ 0, 1, 0 }, Pixel{ 230, 230, 230 })); // Light gray ground plane
-	objects.emplace_back(make_unique<CheckerboardPlane>(Vec3{ 100, -25, 0 }, Vec3{ 0, -1, 0.5 }, 10.0f, Pixel{ 200, 200, 200 }, Pixel{ 50, 50, 50 })); // Checkerboard tilted plane
-
-	objects.emplace_back(make_unique<Sphere>(Vec3{ 0, 0, 0 }, 25, Pixel{ 255, 255, 255 })); // White sphere
-	objects.emplace_back(make_unique<Sphere>(Vec3{ 30, 20, -15 }, 10, Pixel{ 255, 255, 140 })); // Light yellow sphere front, up, right of the first
+	PlaneOutput output{ stdplane };
+	Display3D display{ cols / 2, rows, &output };
+	Display3D spareDisplay{ cols / 2, rows, &output }; // Second buffer for pipelined presenting
+
+	// Persistent render threads (reused every frame)
+	WorkerPool pool{ options.threads };
+	for (Display3D* d : { &display, &spareDisplay }) {
+		apply_backend(*d, options.backend, nc, cols, rows);
+		d->pool = &pool;
+		d->packets = options.packets;
+		d->upscaleFilter = options.upscaleFilter;
+		d->reuse = options.reuse;
+		d->maxSamples = options.samples;
+		d->edgeSampler.budget = options.edgeRays;
+		d->deferred = options.deferred;
+	}
 
-	objects.emplace_back(make_unique<Box>(Vec3{ 0, 10, 0 }, Vec3{ 20, 0, 0 }, Vec3{ 0, 40, 0 }, Vec3{ 0, 0, 30 }, Pixel{ 255, 255, 255 }));
+	FramePacer pacer{ options.targetFps, options.scalePolicy, options.renderScale };
 
-	// Create light sources (directional lights for now)
-	vector<Light> lights = {
-		Light{Vec3{5, -10, 1}, Pixel{182, 34, 228}}, // Back top right (magenta light)
-		Light{Vec3{-10, 3, -1}, Pixel{24, 236, 238 }}, // Front bottom left (cyan light)
-		Light{Vec3{1, 4, -1}, Pixel{100, 100, 100 }}, // Front bottom right (dim white)
+	unique_ptr<PresentPipeline> pipeline;
+	if (options.pipelined) pipeline = make_unique<PresentPipeline>(display, spareDisplay, nc);
 
-		//Light{Vec3{1, -1, -1}, Pixel{ 255, 255, 255 }}, // Front top right (white)
-	};
+	// Sphere moved by the demo animation (none unless asked for, or if the scene has no spheres)
+	size_t demoSphere = scene.objects.size();
+	if (options.animateObject) {
+		for (size_t i = 0; i < scene.objects.size(); ++i) {
+			if (dynamic_cast<Sphere*>(scene.objects[i].get())) {
+				demoSphere = i;
+				break;
+			}
+		}
+	}
 
 	//
 	// Main loop
@@ -660,6 +5098,10 @@ int main() {
 	bool running = true;
 	size_t frame = 0;
 
+	size_t totalCellsTouched = 0; // Cells written to the plane over all frames
+	double totalReused = 0.0; // Fraction of pixels reused, summed over all frames
+	double totalReflectionRays = 0.0; // Reflection rays per pixel, summed over all frames
+
 	KeyState keys;
 	int last_mouse_x = -1, last_mouse_y = -1;
 	bool resized = false;
@@ -668,6 +5110,7 @@ int main() {
 		// auto frameStart = std::chrono::high_resolution_clock::now();
 		// // ? Timing
 
+		pacer.beginFrame();
 		keys.clear(); // Clear previous key states
 
 		// Collect all key presses and mouse movements this frame
@@ -699,8 +5142,11 @@ int main() {
 			rows = cur_rows;
 			cols = cur_cols;
 
+			if (pipeline) pipeline->drain(); // The presenter must not be using the plane or the buffers
 			display.resize(cols / 2, rows);
+			spareDisplay.resize(cols / 2, rows);
 			ncplane_erase(stdplane); // Clear the plane to avoid artifacts
+			output.invalidate();
 
 			// Reset mouse tracking
 			last_mouse_x = -1;
@@ -736,19 +5182,34 @@ int main() {
 		camera.wrapAndClampAngles();
 
 
-		// Example: Move the first sphere
-		auto* sphere = dynamic_cast<Sphere*>(objects[1].get());
-		if (sphere) {
+		// Demo animation (--animate object): drift the first sphere
+		if (demoSphere < scene.objects.size()) {
+			auto* sphere = static_cast<Sphere*>(scene.objects[demoSphere].get());
 			sphere->center.y -= 0.1f;
 			sphere->center.x -= 0.1f;
+			scene.markMoved(demoSphere);
 		}
+		scene.update();
 
 		// camera.orbit(frame, Vec3{ 0, 0, 0 }, 60.0f, Vec3{ 1, 1, -1 }, 2.0f);
 
-		display.clear();
-		display.render_scene_to_image(camera, objects, lights);
-		display.draw_image_to_plane();
-		notcurses_render(nc);
+		Display3D& target = pipeline ? pipeline->backBuffer() : display;
+		target.renderScale = pacer.scale;
+		target.clear();
+		target.render_scene_to_image(camera, scene);
+		totalReused += static_cast<double>(target.history.reusedPixels) / (target.getRenderCols() * target.getRenderRows());
+		totalReflectionRays += static_cast<double>(target.secondaryRays) / (target.getRenderCols() * target.getRenderRows());
+		pacer.markRendered();
+
+		if (pipeline) {
+			pipeline->submit();
+		}
+		else {
+			display.present(nc);
+			totalCellsTouched += output.cellsTouched;
+			notcurses_render(nc);
+		}
+		pacer.markPresented(); // Pipelined: time spent waiting to hand the frame over
 
 		// // ? Timing
 		// auto frameEnd = std::chrono::high_resolution_clock::now();
@@ -764,14 +5225,27 @@ int main() {
 		// if (frame > 180) break;
 		// // ? Timing
 
-		// Optional small sleep to avoid max CPU usage
+		// Sleep until the next frame is due (the time spent rendering and presenting counts toward the frame)
 		++frame;
-		//std::this_thread::sleep_for(std::chrono::milliseconds(10)); // 100 fps
-		std::this_thread::sleep_for(std::chrono::milliseconds(33)); // ~30 fps
+		pacer.waitForNextFrame();
 
 	}
 
+	if (pipeline) {
+		totalCellsTouched += pipeline->totalCellsTouched;
+		pipeline.reset(); // Finish presenting before notcurses shuts down
+	}
+	output.invalidate(); // Destroy the visual plane while notcurses is still running
+
 	ncplane_destroy(stdplane);
 	notcurses_stop(nc);
+
+	if (pacer.frames > 0) {
+		std::cerr << "avg render: " << pacer.totalRenderMs / pacer.frames << " ms, avg present: " << pacer.totalPresentMs / pacer.frames
+			<< " ms, final render scale: " << pacer.scale << "\n";
+	}
+	if (frame > 0 && options.reuse != TemporalReuse::Off) std::cerr << "avg pixels reused: " << 100.0 * totalReused / frame << "%\n";
+	if (frame > 0 && options.reflections > 0) std::cerr << "avg reflection rays: " << totalReflectionRays / frame << " per pixel\n";
+	if (frame > 0) std::cerr << "avg cells touched: " << totalCellsTouched / frame << " per frame (" << (display.getNumCols() / display.cellWidth) * (display.getNumRows() / display.cellHeight) << " cells)\n";
 	return 0;
 }
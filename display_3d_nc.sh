@@ -1,3 +1,3 @@
-g++ -std=c++17 display_3d_nc.cpp -o display_3d_nc -O3 \
+g++ -std=c++17 display_3d_nc.cpp -o display_3d_nc -O3 -march=native -ffp-contract=off -pthread \
     $(pkg-config --cflags --libs notcurses++) || exit
 ./display_3d_nc
\ No newline at end of file